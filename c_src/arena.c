@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <erl_nif.h>
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "erlylua.h"
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define ARENA_ALIGN 16
+#define ARENA_SMALL_MAX 512
+#define ARENA_CLASSES (ARENA_SMALL_MAX / ARENA_ALIGN)
+
+#define ROUND(size) (((size) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+#define CLASS(size) (ROUND(size) / ARENA_ALIGN - 1)
+
+
+/* A block the small objects are bump allocated from */
+typedef struct _arena_block_t {
+    struct _arena_block_t *next;
+    size_t pad;
+} arena_block_t;
+
+/* The header of an object larger than ARENA_SMALL_MAX allocated on its own */
+typedef struct _arena_large_t {
+    struct _arena_large_t *prev;
+    struct _arena_large_t *next;
+} arena_large_t;
+
+/* A freed small object linked into the free list of its size class */
+typedef struct _arena_free_t {
+    struct _arena_free_t *next;
+} arena_free_t;
+
+struct _arena_t {
+    arena_block_t *blocks;
+    char *cur;
+    char *end;
+    arena_free_t *free[ARENA_CLASSES];
+    arena_large_t large;
+};
+
+
+arena_t*
+arena_create(void) {
+    arena_t *a = enif_alloc(sizeof(arena_t));
+    if(a) {
+        memset(a, 0, sizeof(arena_t));
+        a->large.prev = a->large.next = &a->large;
+    }
+    return a;
+}
+
+void
+arena_destroy(arena_t *a) {
+    arena_block_t *block, *next_block;
+    arena_large_t *large, *next_large;
+
+    for(block = a->blocks; block; block = next_block) {
+        next_block = block->next;
+        enif_free(block);
+    }
+    for(large = a->large.next; large != &a->large; large = next_large) {
+        next_large = large->next;
+        enif_free(large);
+    }
+    enif_free(a);
+}
+
+static void*
+small_alloc(arena_t *a, size_t size) {
+    size_t cls = CLASS(size);
+    void *p;
+
+    if(a->free[cls]) {
+        p = a->free[cls];
+        a->free[cls] = a->free[cls]->next;
+        return p;
+    }
+    size = ROUND(size);
+    if(a->cur + size > a->end) {
+        arena_block_t *block = enif_alloc(ARENA_BLOCK_SIZE);
+        if(!block) return NULL;
+        block->next = a->blocks;
+        a->blocks = block;
+        a->cur = (char*)block + ROUND(sizeof(arena_block_t));
+        a->end = (char*)block + ARENA_BLOCK_SIZE;
+    }
+    p = a->cur;
+    a->cur += size;
+    return p;
+}
+
+static void
+small_free(arena_t *a, void *p, size_t size) {
+    arena_free_t *f = (arena_free_t*)p;
+    size_t cls = CLASS(size);
+    f->next = a->free[cls];
+    a->free[cls] = f;
+}
+
+static void*
+large_alloc(arena_t *a, size_t size) {
+    arena_large_t *large = enif_alloc(ROUND(sizeof(arena_large_t)) + size);
+    if(!large) return NULL;
+    large->prev = &a->large;
+    large->next = a->large.next;
+    a->large.next->prev = large;
+    a->large.next = large;
+    return (char*)large + ROUND(sizeof(arena_large_t));
+}
+
+static arena_large_t*
+large_header(void *p) {
+    return (arena_large_t*)((char*)p - ROUND(sizeof(arena_large_t)));
+}
+
+static void
+large_free(arena_t *a, void *p) {
+    arena_large_t *large = large_header(p);
+    large->prev->next = large->next;
+    large->next->prev = large->prev;
+    enif_free(large);
+}
+
+/*
+ * lua_Alloc of the arena states. Small objects are bump allocated from blocks
+ * and reused through the per size class free lists, large objects are allocated
+ * one by one. Nothing is returned to the system until the arena is destroyed
+ */
+void*
+arena_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+    arena_t *a = (arena_t*)ud;
+    void *p;
+
+    if(!ptr) {
+        if(!nsize) return NULL;
+        return nsize <= ARENA_SMALL_MAX ? small_alloc(a, nsize) : large_alloc(a, nsize);
+    }
+    if(!nsize) {
+        if(osize <= ARENA_SMALL_MAX) small_free(a, ptr, osize);
+        else large_free(a, ptr);
+        return NULL;
+    }
+    if(osize <= ARENA_SMALL_MAX && nsize <= ARENA_SMALL_MAX && CLASS(osize) == CLASS(nsize)) {
+        return ptr;
+    }
+    if(osize > ARENA_SMALL_MAX && nsize > ARENA_SMALL_MAX) {
+        arena_large_t *large = large_header(ptr), *moved;
+        arena_large_t *prev = large->prev, *next = large->next;
+        moved = enif_realloc(large, ROUND(sizeof(arena_large_t)) + nsize);
+        if(!moved) return nsize < osize ? ptr : NULL;
+        prev->next = next->prev = moved;
+        return (char*)moved + ROUND(sizeof(arena_large_t));
+    }
+
+    p = nsize <= ARENA_SMALL_MAX ? small_alloc(a, nsize) : large_alloc(a, nsize);
+    if(!p) {
+        /* Lua expects shrinking to succeed. The old object is large enough, keep it */
+        return nsize < osize ? ptr : NULL;
+    }
+    memcpy(p, ptr, osize < nsize ? osize : nsize);
+    if(osize <= ARENA_SMALL_MAX) small_free(a, ptr, osize);
+    else large_free(a, ptr);
+    return p;
+}
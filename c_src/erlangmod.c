@@ -1,10 +1,244 @@
 #include <stdarg.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <erl_nif.h>
 #include <lua.h>
 #include <lauxlib.h>
 
+#include "erlylua.h"
 
-void luaopen_erlang(lua_State *L) {
-    printf("luaopen_erlang() called\n");
-}
\ No newline at end of file
+
+/*
+ * The timers of a state live in a registry table:
+ *   [Id] = the coroutine waiting for the timer,
+ *   pending = {Id1, Ms1, Id2, Ms2, ...} - timers not yet armed on the Erlang side,
+ *   last = the last timer id, active = the number of the waiting coroutines
+ */
+static const char TIMERS_KEY = 't';
+static const char SLEEP_KEY = 's';
+
+
+/*
+ * Push the timers table creating it on the first use
+ */
+static void
+push_timers(lua_State *L) {
+    if(lua_rawgetp(L, LUA_REGISTRYINDEX, &TIMERS_KEY) != LUA_TTABLE) {
+        lua_pop(L, 1);
+        lua_createtable(L, 0, 4);
+        lua_createtable(L, 0, 0);
+        lua_setfield(L, -2, "pending");
+        lua_pushinteger(L, 0);
+        lua_setfield(L, -2, "last");
+        lua_pushinteger(L, 0);
+        lua_setfield(L, -2, "active");
+        lua_pushvalue(L, -1);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, &TIMERS_KEY);
+    }
+}
+
+static lua_Integer
+get_counter(lua_State *L, int idx, const char *name) {
+    lua_Integer value;
+    lua_getfield(L, idx, name);
+    value = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    return value;
+}
+
+static void
+set_counter(lua_State *L, int idx, const char *name, lua_Integer value) {
+    idx = lua_absindex(L, idx);
+    lua_pushinteger(L, value);
+    lua_setfield(L, idx, name);
+}
+
+/*
+ * Ask the Erlang side to fire the timer after the given number of milliseconds.
+ * The timers table must be on the top of the stack
+ */
+static void
+add_pending(lua_State *L, lua_Integer id, lua_Integer ms) {
+    size_t len;
+    lua_getfield(L, -1, "pending");
+    len = lua_rawlen(L, -1);
+    lua_pushinteger(L, id);
+    lua_rawseti(L, -2, len + 1);
+    lua_pushinteger(L, ms < 0 ? 0 : ms);
+    lua_rawseti(L, -2, len + 2);
+    lua_pop(L, 1);
+}
+
+/*
+ * Drop the timer from the ones not yet armed, so no message is scheduled for it.
+ * The timers table must be on the top of the stack
+ */
+static void
+remove_pending(lua_State *L, lua_Integer id) {
+    size_t len, i, j = 0;
+    lua_getfield(L, -1, "pending");
+    len = lua_rawlen(L, -1);
+    for(i = 1; i + 1 <= len; i += 2) {
+        lua_rawgeti(L, -1, i);
+        if(lua_tointeger(L, -1) == id) {
+            lua_pop(L, 1);
+            continue;
+        }
+        lua_rawseti(L, -2, ++j);
+        lua_rawgeti(L, -1, i + 1);
+        lua_rawseti(L, -2, ++j);
+    }
+    for(i = j + 1; i <= len; i++) {
+        lua_pushnil(L);
+        lua_rawseti(L, -2, i);
+    }
+    lua_pop(L, 1);
+}
+
+/*
+ * erlang.timer(ms, fn) - run fn in a new coroutine after ms milliseconds. Returns the timer id
+ */
+static int
+erlang_timer(lua_State *L) {
+    lua_Integer ms = luaL_checkinteger(L, 1), id;
+    lua_State *co;
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+
+    push_timers(L);
+    id = get_counter(L, -1, "last") + 1;
+    set_counter(L, -1, "last", id);
+    set_counter(L, -1, "active", get_counter(L, -1, "active") + 1);
+
+    co = lua_newthread(L);
+    lua_pushvalue(L, 2);
+    lua_xmove(L, co, 1);
+    lua_rawseti(L, -2, id);
+    add_pending(L, id, ms);
+
+    lua_pushinteger(L, id);
+    return 1;
+}
+
+/*
+ * erlang.sleep(ms) - suspend the coroutine started by erlang.timer for ms milliseconds
+ */
+static int
+erlang_sleep(lua_State *L) {
+    lua_Integer ms = luaL_checkinteger(L, 1);
+    lua_settop(L, 0);
+    lua_pushlightuserdata(L, (void*)&SLEEP_KEY);
+    lua_pushinteger(L, ms);
+    return lua_yield(L, 2);
+}
+
+/*
+ * erlang.cancel(id) - forget the timer. Returns true if it was waiting
+ */
+static int
+erlang_cancel(lua_State *L) {
+    lua_Integer id = luaL_checkinteger(L, 1);
+    push_timers(L);
+    if(lua_rawgeti(L, -1, id) == LUA_TTHREAD) {
+        lua_pushnil(L);
+        lua_rawseti(L, -3, id);
+        set_counter(L, -2, "active", get_counter(L, -2, "active") - 1);
+        lua_pop(L, 1);
+        remove_pending(L, id);
+        lua_pushboolean(L, 1);
+    } else {
+        lua_pushboolean(L, 0);
+    }
+    return 1;
+}
+
+void
+luaopen_erlang(lua_State *L) {
+    lua_createtable(L, 0, 3);
+    lua_pushcfunction(L, erlang_timer);
+    lua_setfield(L, -2, "timer");
+    lua_pushcfunction(L, erlang_sleep);
+    lua_setfield(L, -2, "sleep");
+    lua_pushcfunction(L, erlang_cancel);
+    lua_setfield(L, -2, "cancel");
+    lua_setglobal(L, "erlang");
+}
+
+/*
+ * Take the timers not yet armed as [{Id, Ms}] and the number of the waiting coroutines
+ */
+ERL_NIF_TERM
+timers_take(ErlNifEnv *env, lua_State *L) {
+    ERL_NIF_TERM list = enif_make_list(env, 0);
+    size_t len;
+    lua_Integer active;
+
+    push_timers(L);
+    lua_getfield(L, -1, "pending");
+    for(len = lua_rawlen(L, -1); len >= 2; len -= 2) {
+        lua_rawgeti(L, -1, len - 1);
+        lua_rawgeti(L, -2, len);
+        list = enif_make_list_cell(env, enif_make_tuple2(env,
+            enif_make_int64(env, (ErlNifSInt64)lua_tointeger(L, -2)),
+            enif_make_int64(env, (ErlNifSInt64)lua_tointeger(L, -1))), list);
+        lua_pop(L, 2);
+    }
+    lua_pop(L, 1);
+    lua_createtable(L, 0, 0);
+    lua_setfield(L, -2, "pending");
+    active = get_counter(L, -1, "active");
+    lua_pop(L, 1);
+    return enif_make_tuple3(env, enif_make_atom(env, "ok"), list, enif_make_int64(env, (ErlNifSInt64)active));
+}
+
+/*
+ * Resume the coroutine of the fired timer. If it sleeps or yields again, the timer is
+ * added to the pending ones. Ids which are not active (cancelled, finished or unknown)
+ * are ignored: the message of an armed timer still arrives after erlang.cancel.
+ * Returns ok or {error, Reason} if the coroutine failed
+ */
+ERL_NIF_TERM
+timer_fire(ErlNifEnv *env, lua_State *L, ErlNifSInt64 id) {
+    ERL_NIF_TERM ret = enif_make_atom(env, "ok"), reason;
+    lua_State *co;
+    int status, active, top = lua_gettop(L);
+
+    push_timers(L);
+    if(lua_rawgeti(L, -1, (lua_Integer)id) != LUA_TTHREAD) {
+        lua_settop(L, top);
+        return ret;
+    }
+    co = lua_tothread(L, -1);
+    lua_pop(L, 1);
+
+    /* A suspended coroutine gets no values from yield, a new one is started with no arguments */
+    if(lua_status(co) == LUA_YIELD) lua_settop(co, 0);
+    status = lua_resume(co, L, 0);
+
+    /* The coroutine may have cancelled its own timer, then it is no longer counted as active */
+    active = lua_rawgeti(L, -1, (lua_Integer)id) == LUA_TTHREAD && lua_tothread(L, -1) == co;
+    lua_pop(L, 1);
+
+    if(status == LUA_YIELD) {
+        lua_Integer ms = 0;
+        if(lua_gettop(co) >= 2 && lua_touserdata(co, -2) == (void*)&SLEEP_KEY) {
+            ms = lua_tointeger(co, -1);
+        }
+        if(active) add_pending(L, (lua_Integer)id, ms);
+    } else {
+        if(status != LUA_OK) {
+            if(lua_isstring(co, -1)) {
+                reason = enif_make_string(env, lua_tostring(co, -1), ERL_NIF_LATIN1);
+            } else if(!get_term(env, co, -1, 0, &reason)) {
+                reason = enif_make_atom(env, "null");
+            }
+            ret = enif_make_tuple2(env, enif_make_atom(env, "error"), reason);
+        }
+        if(active) {
+            lua_pushnil(L);
+            lua_rawseti(L, -2, (lua_Integer)id);
+            set_counter(L, -1, "active", get_counter(L, -1, "active") - 1);
+        }
+    }
+    lua_settop(L, top);
+    return ret;
+}
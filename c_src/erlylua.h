@@ -0,0 +1,69 @@
+#ifndef ERLYLUA_H
+#define ERLYLUA_H
+
+#include <erl_nif.h>
+#include "lua_compat.h"
+
+/* Maximum nesting of tables and lists converted between Erlang and Lua */
+#define MAX_TERM_DEPTH 32
+
+#ifdef ERL_NIF_DIRTY_JOB_CPU_BOUND
+#define DIRTY_CPU ERL_NIF_DIRTY_JOB_CPU_BOUND
+#else
+#define DIRTY_CPU 0
+#endif
+
+typedef struct _writer_t {
+    void *bin;
+    size_t cur;
+    size_t size;
+} writer_t;
+
+/* erlylua_nif.c */
+lua_State* open_state(void);
+int lua_writer(lua_State *L, const void *p, size_t size, void *ud);
+
+/* erlangmod.c */
+void luaopen_erlang(lua_State *L);
+ERL_NIF_TERM timers_take(ErlNifEnv *env, lua_State *L);
+ERL_NIF_TERM timer_fire(ErlNifEnv *env, lua_State *L, ErlNifSInt64 id);
+
+/* terms.c */
+int push_term(ErlNifEnv *env, lua_State *L, ERL_NIF_TERM term, int depth);
+int get_term(ErlNifEnv *env, lua_State *L, int idx, int depth, ERL_NIF_TERM *term);
+int protected_push_term(ErlNifEnv *env, lua_State *L, ERL_NIF_TERM term);
+int protected_get_term(ErlNifEnv *env, lua_State *L, int idx, ERL_NIF_TERM *term);
+
+/* pmap.c */
+int pmap_init(void);
+void pmap_free(void);
+ERL_NIF_TERM nif_pmap(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]);
+
+/* registry.c */
+int registry_init(void);
+void registry_free(void);
+void registry_open(lua_State *L);
+ERL_NIF_TERM nif_register_module(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM nif_unregister_module(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM nif_registered_modules(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]);
+
+/* shared.c */
+int shared_init(ErlNifEnv *env);
+int shared_push(ErlNifEnv *env, lua_State *L, ERL_NIF_TERM term);
+ERL_NIF_TERM nif_newshared(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]);
+
+/* arena.c */
+typedef struct _arena_t arena_t;
+arena_t* arena_create(void);
+void arena_destroy(arena_t *a);
+void* arena_alloc(void *ud, void *ptr, size_t osize, size_t nsize);
+
+/* recorder.c */
+typedef struct _recorder_t recorder_t;
+extern volatile int RECORDERS;
+recorder_t* recorder_start(const char *filename);
+int recorder_stop(recorder_t *r);
+void recorder_log(recorder_t *r, ErlNifEnv *env, const char *op, int args, const ERL_NIF_TERM argv[],
+    ErlNifTime start, ErlNifTime duration);
+
+#endif
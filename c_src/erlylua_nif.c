@@ -1,4 +1,5 @@
 #include <stdarg.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <erl_nif.h>
@@ -6,25 +7,22 @@
 #include <lualib.h>
 #include <lauxlib.h>
 
+#include "erlylua.h"
+
 
 typedef struct _res_t {
     lua_State *lua;
     lua_State *L;
+    recorder_t *recorder;
+    ErlNifMutex *lock;          /* guards recorder against stop_recording and close on other schedulers */
+    arena_t *arena;
 } res_t;
 
-typedef struct _writer_t {
-    void *bin;
-    size_t cur;
-    size_t size;
-} writer_t;
-
 
 static ErlNifResourceType *LUA_RESOURCE;
 static const char *RESOURCE_ERROR = "First argument is not a Lua VM instance";
 static const char *LUA_ERROR = "Lua VM is not initialized";
 
-void luaopen_erlang(lua_State *L);
-
 #define ATOM(name) (enif_make_atom(env, name))
 #define ATOM_OK ATOM("ok")
 #define ATOM_ERROR ATOM("error")
@@ -42,20 +40,24 @@ void luaopen_erlang(lua_State *L);
 
 static ERL_NIF_TERM
 nif_niferror(ErlNifEnv *env, const char *format,...) {
-    va_list aptr;
-    size_t size;
-    char *buf;
+    va_list aptr, copy;
+    char stack_buf[256], *buf = stack_buf;
+    int size;
     ERL_NIF_TERM term;
     
     va_start(aptr, format);
-    size = vsnprintf(NULL, 0, format, aptr) + 1;
-    if((buf = malloc(size))) {
-        vsnprintf((char*)buf, size, format, aptr); buf[size] = '0';
+    va_copy(copy, aptr);
+    size = vsnprintf(buf, sizeof(stack_buf), format, aptr);
+    if(size >= (int)sizeof(stack_buf) && (buf = malloc(size + 1))) {
+        vsnprintf(buf, size + 1, format, copy);
+    }
+    if(size >= 0 && buf) {
         term = enif_make_string(env, buf, ERL_NIF_LATIN1);
-        free(buf);
     } else {
         term = ATOM_NULL;
     }
+    if(buf != stack_buf) free(buf);
+    va_end(copy);
     va_end(aptr);
     return enif_make_tuple2(env, ATOM_ERROR, term);
 }
@@ -75,23 +77,231 @@ decode_string(ErlNifEnv *env, ERL_NIF_TERM term, size_t *size) {
     return 0;
 }
 
+
+/*
+ * Argument validation. Every check makes the NIF return badarg instead of handing
+ * a bad index or count over to the Lua API, which does not check them
+ */
+#define GET_INT(env, term, var) \
+    if(!enif_get_int(env, term, &var)) return enif_make_badarg(env);
+
+#define GET_INDEX(env, L, term, var, check) \
+    if(!enif_get_int(env, term, &var) || !check(L, var)) return enif_make_badarg(env);
+
+#define CHECK_TOP(env, L, n) \
+    if((n) < 0 || lua_gettop(L) < (n)) return enif_make_badarg(env);
+
+#define CHECK_STACK(env, L, n) \
+    if(!lua_checkstack(L, n)) return nif_niferror(env, "Stack overflow");
+
+/* An index of a value on the stack */
+static int
+stack_index(lua_State *L, int idx) {
+    int top = lua_gettop(L);
+    return (idx > 0 && idx <= top) || (idx < 0 && -idx <= top);
+}
+
+/* An index of a value on the stack or the registry */
+static int
+valid_index(lua_State *L, int idx) {
+    return stack_index(L, idx) || idx == LUA_REGISTRYINDEX;
+}
+
+/* A valid index or an index above the top within the stack space, the value there is none */
+static int
+acceptable_index(lua_State *L, int idx) {
+    int top = lua_gettop(L);
+    return valid_index(L, idx) || (idx > top && lua_checkstack(L, idx - top));
+}
+
+/* Can accessing the value at the given index call a metamethod */
+static int
+has_metatable(lua_State *L, int idx) {
+    if(!lua_getmetatable(L, idx)) return 0;
+    lua_pop(L, 1);
+    return 1;
+}
+
+
+/*
+ * The operations which may raise a Lua error (metamethods, memory errors, bad keys).
+ * They never run directly on the stack of the state, but under lua_pcall
+ */
+enum {
+    OP_GETTABLE, OP_GETFIELD, OP_GETI, OP_GETGLOBAL,
+    OP_SETTABLE, OP_SETFIELD, OP_SETI, OP_SETGLOBAL, OP_RAWSET, OP_RAWSETI,
+    OP_COMPARE, OP_LEN, OP_CONCAT, OP_NEXT, OP_TOSTRING,
+    OP_PUSHSTRING, OP_CREATETABLE, OP_NEWUSERDATA, OP_ERROR, OP_GC,
+    OP_TIMERS, OP_FIRE_TIMER, OP_PUSHSHARED
+};
+
+typedef struct _guard_t {
+    int op;
+    int n1, n2;
+    lua_Integer i;
+    const char *str;
+    size_t size;
+    ErlNifEnv *env;
+    ERL_NIF_TERM term;
+} guard_t;
+
+/*
+ * The function called under lua_pcall. The guard is the first argument,
+ * the object of the operation (if any) and its operands follow
+ */
+static int
+guarded_op(lua_State *L) {
+    guard_t *g = (guard_t*)lua_touserdata(L, 1);
+    switch(g->op) {
+        case OP_GETTABLE: lua_gettable(L, 2); return 1;
+        case OP_GETFIELD: lua_getfield(L, 2, g->str); return 1;
+        case OP_GETI: lua_geti(L, 2, g->i); return 1;
+        case OP_GETGLOBAL: lua_getglobal(L, g->str); return 1;
+        case OP_SETTABLE: lua_settable(L, 2); return 0;
+        case OP_SETFIELD: lua_setfield(L, 2, g->str); return 0;
+        case OP_SETI: lua_seti(L, 2, g->i); return 0;
+        case OP_SETGLOBAL: lua_setglobal(L, g->str); return 0;
+        case OP_RAWSET: lua_rawset(L, 2); return 0;
+        case OP_RAWSETI: lua_rawseti(L, 2, g->i); return 0;
+        case OP_COMPARE: lua_pushboolean(L, lua_compare(L, 2, 3, g->n1)); return 1;
+        case OP_LEN: lua_len(L, 2); return 1;
+        case OP_CONCAT: lua_concat(L, g->n1); return 1;
+        case OP_NEXT: return lua_next(L, 2) ? 2 : 0;
+        case OP_TOSTRING: lua_tolstring(L, 2, NULL); lua_settop(L, 2); return 1;
+        case OP_PUSHSTRING: lua_pushlstring(L, g->str, g->size); return 1;
+        case OP_CREATETABLE: lua_createtable(L, g->n1, g->n2); return 1;
+        case OP_NEWUSERDATA: {
+            void *p = lua_newuserdata(L, g->size);
+            if(g->size) memcpy(p, g->str, g->size);
+            return 1;
+        }
+        case OP_ERROR: lua_settop(L, 2); return lua_error(L);
+        case OP_GC: lua_pushinteger(L, lua_gc(L, g->n1, g->n2)); return 1;
+        case OP_TIMERS: g->term = timers_take(g->env, L); return 0;
+        case OP_FIRE_TIMER: g->term = timer_fire(g->env, L, (ErlNifSInt64)g->i); return 0;
+        case OP_PUSHSHARED: return g->n1 = shared_push(g->env, L, g->term);
+        default: return 0;
+    }
+}
+
+/*
+ * Run the operation under lua_pcall. The value at idx (unless it is 0) and the ntop values
+ * from the top of the stack are passed to it. On success the ntop values are replaced
+ * by the results of the operation and the number of results is returned.
+ * On failure the stack is left as it was, *error is set to {error, Reason} and -1 is returned
+ */
+static int
+guarded(ErlNifEnv *env, lua_State *L, guard_t *g, int idx, int ntop, ERL_NIF_TERM *error) {
+    int i, top = lua_gettop(L), base = top - ntop, status;
+    if(idx) idx = lua_absindex(L, idx);
+    if(!lua_checkstack(L, ntop + 3)) {
+        *error = nif_niferror(env, "Stack overflow");
+        return -1;
+    }
+    lua_pushcfunction(L, guarded_op);
+    lua_pushlightuserdata(L, g);
+    if(idx) lua_pushvalue(L, idx);
+    for(i = base + 1; i <= top; i++) lua_pushvalue(L, i);
+    status = lua_pcall(L, ntop + (idx ? 2 : 1), LUA_MULTRET, 0);
+    if(status != LUA_OK) {
+        if(lua_isstring(L, -1)) {
+            *error = nif_niferror(env, "%s", lua_tostring(L, -1));
+        } else {
+            *error = enif_make_tuple2(env, ATOM_ERROR, enif_make_int(env, status));
+        }
+        lua_settop(L, top);
+        return -1;
+    }
+    if(ntop) {
+        lua_rotate(L, base + 1, -ntop);
+        lua_pop(L, ntop);
+    }
+    return lua_gettop(L) - base;
+}
+
+static lua_State*
+init_state(lua_State *L) {
+    if(L) {
+        luaL_openlibs(L);
+        luaopen_erlang(L);
+        registry_open(L);
+    }
+    return L;
+}
+
+/*
+ * Create a new Lua state with the standard and the erlang libraries opened
+ */
+lua_State*
+open_state(void) {
+    return init_state(luaL_newstate());
+}
+
+/*
+ * Detach the recorder from the state, the caller stops it
+ */
+static recorder_t*
+take_recorder(res_t *res) {
+    recorder_t *r;
+    enif_mutex_lock(res->lock);
+    r = res->recorder;
+    res->recorder = NULL;
+    enif_mutex_unlock(res->lock);
+    return r;
+}
+
+/*
+ * A state dropped while being recorded still flushes its log and stops the writer thread
+ */
+static void
+res_dtor(ErlNifEnv *env, void *obj) {
+    res_t *res = (res_t*)obj;
+    recorder_t *r;
+    if(res->lock) {
+        if((r = take_recorder(res))) recorder_stop(r);
+        enif_mutex_destroy(res->lock);
+    }
+}
+
 static int
 nif_load(ErlNifEnv *env, void **priv_data, ERL_NIF_TERM load_info) {
-    LUA_RESOURCE = enif_open_resource_type(env, NULL, "erlylua_nif", NULL, ERL_NIF_RT_CREATE, NULL);
-    return 0;
+    LUA_RESOURCE = enif_open_resource_type(env, NULL, "erlylua_nif", res_dtor, ERL_NIF_RT_CREATE, NULL);
+    return registry_init() && shared_init(env) && pmap_init() ? 0 : 1;
+}
+
+static void
+nif_unload(ErlNifEnv *env, void *priv_data) {
+    pmap_free();
+    registry_free();
 }
 
 static ERL_NIF_TERM 
 nif_newstate(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
-    lua_State *L = luaL_newstate();
+    lua_State *L;
+    arena_t *arena = NULL;
+    if(args > 0 && enif_is_identical(argv[0], ATOM("arena"))) {
+        if(!(arena = arena_create())) return nif_niferror(env, "Could not initialize the Lua VM");
+        L = init_state(lua_newstate(arena_alloc, arena));
+    } else if(args > 0 && !enif_is_identical(argv[0], ATOM("default"))) {
+        return enif_make_badarg(env);
+    } else {
+        L = open_state();
+    }
     if(!L) {
+        if(arena) arena_destroy(arena);
         return nif_niferror(env, "Could not initialize the Lua VM");
     } else {
-        luaL_openlibs(L);
-        luaopen_erlang(L);
         res_t *res = (res_t*)enif_alloc_resource(LUA_RESOURCE, sizeof(res_t));
         res->lua = L;
         res->L = lua_newthread(L);
+        res->recorder = NULL;
+        res->arena = arena;
+        if(!(res->lock = enif_mutex_create("erlylua_state"))) {
+            lua_close(L);
+            if(arena) arena_destroy(arena);
+            enif_release_resource(res);
+            return nif_niferror(env, "Could not initialize the Lua VM");
+        }
         return enif_make_resource(env, res);
     }
 }
@@ -99,7 +309,14 @@ nif_newstate(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
 static ERL_NIF_TERM 
 nif_close(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
     GET_RESOURCE(env, args, argv);
+    recorder_t *r = take_recorder(res);
+    if(r) recorder_stop(r);
+    /* Finalizers run as usual, the freed objects only go back to the free lists of the arena */
     lua_close(res->lua);
+    if(res->arena) {
+        arena_destroy(res->arena);
+        res->arena = NULL;
+    }
     res->lua = res->L = 0;
     enif_release_resource(res);
     return ATOM_OK;
@@ -108,15 +325,14 @@ nif_close(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
 static ERL_NIF_TERM 
 nif_version(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
     GET_RESOURCE(env, args, argv);
-    const lua_Number *version = lua_version(res->L);
-    return enif_make_tuple2(env, ATOM_OK, enif_make_double(env, *version));
+    return enif_make_tuple2(env, ATOM_OK, enif_make_double(env, compat_version(res->L)));
 }
 
 static ERL_NIF_TERM 
 nif_absindex(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
     GET_RESOURCE(env, args, argv);
     int idx;
-    enif_get_int(env, argv[1], &idx);
+    GET_INT(env, argv[1], idx);
     return enif_make_tuple2(env, ATOM_OK, enif_make_int(env, lua_absindex(res->L, idx)));
 }
 
@@ -129,8 +345,11 @@ nif_gettop(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
 static ERL_NIF_TERM 
 nif_settop(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
     GET_RESOURCE(env, args, argv);
-    int idx;
-    enif_get_int(env, argv[1], &idx);
+    int idx, top = lua_gettop(res->L);
+    GET_INT(env, argv[1], idx);
+    if(idx < -(top + 1) || (idx > top && !lua_checkstack(res->L, idx - top))) {
+        return enif_make_badarg(env);
+    }
     lua_settop(res->L, idx);
     return ATOM_OK;
 }
@@ -139,7 +358,8 @@ static ERL_NIF_TERM
 nif_pushvalue(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
     GET_RESOURCE(env, args, argv);
     int idx;
-    enif_get_int(env, argv[1], &idx);
+    GET_INDEX(env, res->L, argv[1], idx, valid_index);
+    CHECK_STACK(env, res->L, 1);
     lua_pushvalue(res->L, idx);
     return ATOM_OK;
 }
@@ -147,9 +367,11 @@ nif_pushvalue(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
 static ERL_NIF_TERM 
 nif_rotate(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
     GET_RESOURCE(env, args, argv);
-    int idx, n;
-    enif_get_int(env, argv[1], &idx);
-    enif_get_int(env, argv[2], &n);
+    int idx, n, size;
+    GET_INDEX(env, res->L, argv[1], idx, stack_index);
+    GET_INT(env, argv[2], n);
+    size = lua_gettop(res->L) - lua_absindex(res->L, idx) + 1;
+    if(n > size || n < -size) return enif_make_badarg(env);
     lua_rotate(res->L, idx, n);
     return ATOM_OK;
 }
@@ -158,8 +380,8 @@ static ERL_NIF_TERM
 nif_copy(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
     GET_RESOURCE(env, args, argv);
     int from, to;
-    enif_get_int(env, argv[1], &from);
-    enif_get_int(env, argv[2], &to);
+    GET_INDEX(env, res->L, argv[1], from, valid_index);
+    GET_INDEX(env, res->L, argv[2], to, stack_index);
     lua_copy(res->L, from, to);
     return ATOM_OK;
 }
@@ -168,7 +390,8 @@ static ERL_NIF_TERM
 nif_checkstack(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
     GET_RESOURCE(env, args, argv);
     int n;
-    enif_get_int(env, argv[1], &n);
+    GET_INT(env, argv[1], n);
+    if(n < 0) return enif_make_badarg(env);
     n = lua_checkstack(res->L, n);
     return enif_make_tuple2(env, ATOM_OK, n ? ATOM_TRUE : ATOM_FALSE);
 }
@@ -177,7 +400,7 @@ static ERL_NIF_TERM
 nif_isnumber(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
     GET_RESOURCE(env, args, argv);
     int idx;
-    enif_get_int(env, argv[1], &idx);
+    GET_INDEX(env, res->L, argv[1], idx, acceptable_index);
     idx = lua_isnumber(res->L, idx);
     return enif_make_tuple2(env, ATOM_OK, idx ? ATOM_TRUE : ATOM_FALSE);
 }
@@ -186,7 +409,7 @@ static ERL_NIF_TERM
 nif_isinteger(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
     GET_RESOURCE(env, args, argv);
     int idx;
-    enif_get_int(env, argv[1], &idx);
+    GET_INDEX(env, res->L, argv[1], idx, acceptable_index);
     idx = lua_isinteger(res->L, idx);
     return enif_make_tuple2(env, ATOM_OK, idx ? ATOM_TRUE : ATOM_FALSE);
 }
@@ -195,7 +418,7 @@ static ERL_NIF_TERM
 nif_isstring(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
     GET_RESOURCE(env, args, argv);
     int idx;
-    enif_get_int(env, argv[1], &idx);
+    GET_INDEX(env, res->L, argv[1], idx, acceptable_index);
     idx = lua_isstring(res->L, idx);
     return enif_make_tuple2(env, ATOM_OK, idx ? ATOM_TRUE : ATOM_FALSE);
 }
@@ -204,7 +427,7 @@ static ERL_NIF_TERM
 nif_iscfunction(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
     GET_RESOURCE(env, args, argv);
     int idx;
-    enif_get_int(env, argv[1], &idx);
+    GET_INDEX(env, res->L, argv[1], idx, acceptable_index);
     idx = lua_iscfunction(res->L, idx);
     return enif_make_tuple2(env, ATOM_OK, idx ? ATOM_TRUE : ATOM_FALSE);
 }
@@ -213,7 +436,7 @@ static ERL_NIF_TERM
 nif_isuserdata(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
     GET_RESOURCE(env, args, argv);
     int idx;
-    enif_get_int(env, argv[1], &idx);
+    GET_INDEX(env, res->L, argv[1], idx, acceptable_index);
     idx = lua_isuserdata(res->L, idx);
     return enif_make_tuple2(env, ATOM_OK, idx ? ATOM_TRUE : ATOM_FALSE);
 }
@@ -222,7 +445,7 @@ static ERL_NIF_TERM
 nif_islightuserdata(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
     GET_RESOURCE(env, args, argv);
     int idx;
-    enif_get_int(env, argv[1], &idx);
+    GET_INDEX(env, res->L, argv[1], idx, acceptable_index);
     idx = lua_islightuserdata(res->L, idx);
     return enif_make_tuple2(env, ATOM_OK, idx ? ATOM_TRUE : ATOM_FALSE);
 }
@@ -240,7 +463,7 @@ static ERL_NIF_TERM
 nif_type(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
     GET_RESOURCE(env, args, argv);
     int idx;
-    enif_get_int(env, argv[1], &idx);
+    GET_INDEX(env, res->L, argv[1], idx, acceptable_index);
     return ok_type_tuple(env, res->L, lua_type(res->L, idx));
 }
 
@@ -249,12 +472,12 @@ nif_tonumber(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
     GET_RESOURCE(env, args, argv);
     int idx, isnum;
     lua_Number num;
-    enif_get_int(env, argv[1], &idx);
+    GET_INDEX(env, res->L, argv[1], idx, acceptable_index);
     num = lua_tonumberx(res->L, idx, &isnum);
     if(isnum) {
         return enif_make_tuple2(env, ATOM_OK, enif_make_double(env, num));
     } else {
-        return nif_niferror(env, typename(res->L, lua_type(res->L, idx)));
+        return nif_niferror(env, "%s", typename(res->L, lua_type(res->L, idx)));
     }
 }
 
@@ -263,20 +486,89 @@ nif_tointeger(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
     GET_RESOURCE(env, args, argv);
     int idx, isnum;
     lua_Integer num;
-    enif_get_int(env, argv[1], &idx);
+    GET_INDEX(env, res->L, argv[1], idx, acceptable_index);
+    num = lua_tointegerx(res->L, idx, &isnum);
+    if(isnum) {
+        return enif_make_tuple2(env, ATOM_OK, enif_make_int64(env, num));
+    } else {
+        return nif_niferror(env, "%s", typename(res->L, lua_type(res->L, idx)));
+    }
+}
+
+static ERL_NIF_TERM 
+nif_tonumber_raw(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
+    res_t *res;
+    int idx, isnum;
+    lua_Number num;
+    if(!enif_get_resource(env, argv[0], LUA_RESOURCE, (void**)&res) || !res->L
+        || !enif_get_int(env, argv[1], &idx) || !acceptable_index(res->L, idx)) {
+        return enif_make_badarg(env);
+    }
+    num = lua_tonumberx(res->L, idx, &isnum);
+    return isnum ? enif_make_double(env, num) : enif_make_badarg(env);
+}
+
+static ERL_NIF_TERM 
+nif_tointeger_raw(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
+    res_t *res;
+    int idx, isnum;
+    lua_Integer num;
+    if(!enif_get_resource(env, argv[0], LUA_RESOURCE, (void**)&res) || !res->L
+        || !enif_get_int(env, argv[1], &idx) || !acceptable_index(res->L, idx)) {
+        return enif_make_badarg(env);
+    }
     num = lua_tointegerx(res->L, idx, &isnum);
+    return isnum ? enif_make_int64(env, num) : enif_make_badarg(env);
+}
+
+/*
+ * Convert the values at the list of indices to integers (if integer is true) or to doubles.
+ * Return {ok, Values} or {error, Type} with the type of the first value which could not be converted
+ */
+static ERL_NIF_TERM 
+to_numbers(ErlNifEnv *env, lua_State *L, ERL_NIF_TERM list, int integer) {
+    ERL_NIF_TERM head, ret, *values;
+    unsigned i, count;
+    int idx = 0, isnum = 1;
+    if(!enif_get_list_length(env, list, &count)) return enif_make_badarg(env);
+    values = enif_alloc(sizeof(ERL_NIF_TERM) * (count ? count : 1));
+    for(i = 0; isnum && enif_get_list_cell(env, list, &head, &list); i++) {
+        if(!enif_get_int(env, head, &idx) || !acceptable_index(L, idx)) {
+            enif_free(values);
+            return enif_make_badarg(env);
+        }
+        if(integer) {
+            values[i] = enif_make_int64(env, lua_tointegerx(L, idx, &isnum));
+        } else {
+            values[i] = enif_make_double(env, lua_tonumberx(L, idx, &isnum));
+        }
+    }
     if(isnum) {
-        return enif_make_tuple2(env, ATOM_OK, enif_make_int(env, num));
+        ret = enif_make_tuple2(env, ATOM_OK, enif_make_list_from_array(env, values, count));
     } else {
-        return nif_niferror(env, typename(res->L, lua_type(res->L, idx)));
+        ret = nif_niferror(env, "%s", typename(L, lua_type(L, idx)));
     }
+    enif_free(values);
+    return ret;
+}
+
+static ERL_NIF_TERM 
+nif_tonumbers(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
+    GET_RESOURCE(env, args, argv);
+    return to_numbers(env, res->L, argv[1], 0);
+}
+
+static ERL_NIF_TERM 
+nif_tointegers(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
+    GET_RESOURCE(env, args, argv);
+    return to_numbers(env, res->L, argv[1], 1);
 }
 
 static ERL_NIF_TERM 
 nif_toboolean(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
     GET_RESOURCE(env, args, argv);
     int idx, ret;
-    enif_get_int(env, argv[1], &idx);
+    GET_INDEX(env, res->L, argv[1], idx, acceptable_index);
     ret = lua_toboolean(res->L, idx);
     return enif_make_tuple2(env, ATOM_OK, ret ? ATOM_TRUE : ATOM_FALSE);
 }
@@ -284,17 +576,28 @@ nif_toboolean(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
 static ERL_NIF_TERM 
 nif_tostring(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
     GET_RESOURCE(env, args, argv);
-    int idx;
+    int idx, type;
     size_t size;
+    const char *str;
     ErlNifBinary bin;
-    enif_get_int(env, argv[1], &idx);
-    const char *str = lua_tolstring(res->L, idx, &size);
+    ERL_NIF_TERM error;
+    GET_INDEX(env, res->L, argv[1], idx, acceptable_index);
+    type = lua_type(res->L, idx);
+    if(type == LUA_TNUMBER) {
+        /* The conversion allocates the string, do it on a copy and put the result in place */
+        guard_t g = {OP_TOSTRING};
+        idx = lua_absindex(res->L, idx);
+        if(guarded(env, res->L, &g, idx, 0, &error) < 0) return error;
+        lua_replace(res->L, idx);
+    } else if(type != LUA_TSTRING) {
+        return nif_niferror(env, "%s", typename(res->L, type));
+    }
+    str = lua_tolstring(res->L, idx, &size);
     if(str && enif_alloc_binary(size, &bin)) {
-        //bin.size = size;
         memcpy((void*)bin.data, str, size);
         return enif_make_tuple2(env, ATOM_OK, enif_make_binary(env, &bin));
     } else {
-        return nif_niferror(env, typename(res->L, lua_type(res->L, idx)));
+        return nif_niferror(env, "%s", typename(res->L, lua_type(res->L, idx)));
     }
 }
 
@@ -302,7 +605,7 @@ static ERL_NIF_TERM
 nif_touserdata(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
     GET_RESOURCE(env, args, argv);
     int idx;
-    enif_get_int(env, argv[1], &idx);
+    GET_INDEX(env, res->L, argv[1], idx, acceptable_index);
     if(lua_isuserdata(res->L, idx)) {
         ErlNifBinary bin;
         size_t size = lua_rawlen(res->L, idx);
@@ -315,39 +618,59 @@ nif_touserdata(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
         }
         return enif_make_tuple2(env, ATOM_ERROR, ATOM_NULL);
     }
-    return nif_niferror(env, typename(res->L, lua_type(res->L, idx)));
+    return nif_niferror(env, "%s", typename(res->L, lua_type(res->L, idx)));
 }
 
 static ERL_NIF_TERM 
 nif_rawlen(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
     GET_RESOURCE(env, args, argv);
     int idx;
-    enif_get_int(env, argv[1], &idx);
-    return enif_make_tuple2(env, ATOM_OK, enif_make_int(env, lua_rawlen(res->L, idx)));
+    GET_INDEX(env, res->L, argv[1], idx, acceptable_index);
+    return enif_make_tuple2(env, ATOM_OK, enif_make_uint64(env, lua_rawlen(res->L, idx)));
 }
 
 static ERL_NIF_TERM 
 nif_rawequal(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
     GET_RESOURCE(env, args, argv);
     int idx1, idx2;
-    enif_get_int(env, argv[1], &idx1);
-    enif_get_int(env, argv[2], &idx2);
+    GET_INDEX(env, res->L, argv[1], idx1, acceptable_index);
+    GET_INDEX(env, res->L, argv[2], idx2, acceptable_index);
     return enif_make_tuple2(env, ATOM_OK, lua_rawequal(res->L, idx1, idx2) ? ATOM_TRUE : ATOM_FALSE);
 }
 
 static ERL_NIF_TERM 
 nif_compare(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
     GET_RESOURCE(env, args, argv);
-    int idx1, idx2, op;
-    enif_get_int(env, argv[1], &idx1);
-    enif_get_int(env, argv[2], &idx2);
-    enif_get_int(env, argv[3], &op);
-    return enif_make_tuple2(env, ATOM_OK, lua_compare(res->L, idx1, idx2, op) ? ATOM_TRUE : ATOM_FALSE);
+    int idx1, idx2, op, ret;
+    ERL_NIF_TERM error;
+    GET_INDEX(env, res->L, argv[1], idx1, acceptable_index);
+    GET_INDEX(env, res->L, argv[2], idx2, acceptable_index);
+    GET_INT(env, argv[3], op);
+    if(op != LUA_OPEQ && op != LUA_OPLT && op != LUA_OPLE) return enif_make_badarg(env);
+    if(!valid_index(res->L, idx1) || !valid_index(res->L, idx2)) {
+        /* Like lua_compare, a comparison with a non-valid index is false */
+        ret = 0;
+    } else if(lua_type(res->L, idx1) == LUA_TNUMBER && lua_type(res->L, idx2) == LUA_TNUMBER) {
+        ret = lua_compare(res->L, idx1, idx2, op);
+    } else {
+        guard_t g = {OP_COMPARE, op};
+        idx1 = lua_absindex(res->L, idx1);
+        CHECK_STACK(env, res->L, 1);
+        lua_pushvalue(res->L, idx2);
+        if(guarded(env, res->L, &g, idx1, 1, &error) < 0) {
+            lua_pop(res->L, 1);
+            return error;
+        }
+        ret = lua_toboolean(res->L, -1);
+        lua_pop(res->L, 1);
+    }
+    return enif_make_tuple2(env, ATOM_OK, ret ? ATOM_TRUE : ATOM_FALSE);
 }
 
 static ERL_NIF_TERM 
 nif_pushnil(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
     GET_RESOURCE(env, args, argv);
+    CHECK_STACK(env, res->L, 1);
     lua_pushnil(res->L);
     return ATOM_OK;
 }
@@ -355,9 +678,10 @@ nif_pushnil(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
 static ERL_NIF_TERM 
 nif_pushinteger(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
     GET_RESOURCE(env, args, argv);
-    int num;
-    enif_get_int(env, argv[1], &num);
-    lua_pushinteger(res->L, num);
+    ErlNifSInt64 num;
+    if(!enif_get_int64(env, argv[1], &num)) return enif_make_badarg(env);
+    CHECK_STACK(env, res->L, 1);
+    lua_pushinteger(res->L, (lua_Integer)num);
     return ATOM_OK;
 }
 
@@ -365,7 +689,8 @@ static ERL_NIF_TERM
 nif_pushnumber(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
     GET_RESOURCE(env, args, argv);
     double num;
-    enif_get_double(env, argv[1], &num);
+    if(!enif_get_double(env, argv[1], &num)) return enif_make_badarg(env);
+    CHECK_STACK(env, res->L, 1);
     lua_pushnumber(res->L, num);
     return ATOM_OK;
 }
@@ -373,12 +698,13 @@ nif_pushnumber(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
 static ERL_NIF_TERM 
 nif_pushstring(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
     GET_RESOURCE(env, args, argv);
-    size_t size;
-    char *str = decode_string(env, argv[1], &size);
-    if(str) {
-        lua_pushlstring(res->L, str, size);
-        free(str);
-        return ATOM_OK;
+    ErlNifBinary bin;
+    ERL_NIF_TERM error;
+    if(enif_inspect_binary(env, argv[1], &bin)) {
+        guard_t g = {OP_PUSHSTRING};
+        g.str = (const char*)bin.data;
+        g.size = bin.size;
+        return guarded(env, res->L, &g, 0, 0, &error) < 0 ? error : ATOM_OK;
     } else {
         return enif_make_tuple2(env, ATOM_ERROR, ATOM_NULL);
     }
@@ -388,7 +714,8 @@ static ERL_NIF_TERM
 nif_pushboolean(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
     GET_RESOURCE(env, args, argv);
     int num;
-    enif_get_int(env, argv[1], &num);
+    GET_INT(env, argv[1], num);
+    CHECK_STACK(env, res->L, 1);
     lua_pushboolean(res->L, num);
     return ATOM_OK;
 }
@@ -397,11 +724,15 @@ static ERL_NIF_TERM
 nif_getglobal(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
     GET_RESOURCE(env, args, argv);
     size_t size;
+    ERL_NIF_TERM error;
     char *str = decode_string(env, argv[1], &size);
     if(str) {
-        int type = lua_getglobal(res->L, str);
+        guard_t g = {OP_GETGLOBAL};
+        int ret;
+        g.str = str;
+        ret = guarded(env, res->L, &g, 0, 0, &error);
         free(str);
-        return ok_type_tuple(env, res->L, type);
+        return ret < 0 ? error : ok_type_tuple(env, res->L, lua_type(res->L, -1));
     } else {
         return enif_make_tuple2(env, ATOM_ERROR, ATOM_NULL);
     }
@@ -411,12 +742,20 @@ static ERL_NIF_TERM
 nif_gettable(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
     GET_RESOURCE(env, args, argv);
     int idx;
-    enif_get_int(env, argv[1], &idx);
+    ERL_NIF_TERM error;
+    GET_INDEX(env, res->L, argv[1], idx, valid_index);
+    CHECK_TOP(env, res->L, 1);
+    CHECK_STACK(env, res->L, 1);
     if(lua_istable(res->L, idx)) {
-        int type = lua_gettable(res->L, idx);
-        return ok_type_tuple(env, res->L, type);
+        if(!has_metatable(res->L, idx)) {
+            return ok_type_tuple(env, res->L, lua_rawget(res->L, idx));
+        } else {
+            guard_t g = {OP_GETTABLE};
+            if(guarded(env, res->L, &g, idx, 1, &error) < 0) return error;
+            return ok_type_tuple(env, res->L, lua_type(res->L, -1));
+        }
     } else {
-        return nif_niferror(env, typename(res->L, lua_type(res->L, idx)));
+        return nif_niferror(env, "%s", typename(res->L, lua_type(res->L, idx)));
     }
 }
 
@@ -424,33 +763,46 @@ static ERL_NIF_TERM
 nif_getfield(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
     GET_RESOURCE(env, args, argv);
     int idx;
-    enif_get_int(env, argv[1], &idx);
+    ERL_NIF_TERM error;
+    GET_INDEX(env, res->L, argv[1], idx, valid_index);
     if(lua_istable(res->L, idx)) {
         size_t size;
         char *str = decode_string(env, argv[2], &size);
         if(str) {
-            int type = lua_getfield(res->L, idx, str);
+            guard_t g = {OP_GETFIELD};
+            int ret;
+            g.str = str;
+            ret = guarded(env, res->L, &g, idx, 0, &error);
             free(str);
-            return ok_type_tuple(env, res->L, type);
+            return ret < 0 ? error : ok_type_tuple(env, res->L, lua_type(res->L, -1));
         } else {
             return nif_niferror(env, "Could not get binary from the third argument");
         }
     } else {
-        return nif_niferror(env, typename(res->L, lua_type(res->L, idx)));
+        return nif_niferror(env, "%s", typename(res->L, lua_type(res->L, idx)));
     }
 }
 
 static ERL_NIF_TERM 
 nif_geti(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
     GET_RESOURCE(env, args, argv);
-    int idx, i;
-    enif_get_int(env, argv[1], &idx);
+    int idx;
+    ErlNifSInt64 i;
+    ERL_NIF_TERM error;
+    GET_INDEX(env, res->L, argv[1], idx, valid_index);
+    if(!enif_get_int64(env, argv[2], &i)) return enif_make_badarg(env);
+    CHECK_STACK(env, res->L, 1);
     if(lua_istable(res->L, idx)) {
-        enif_get_int(env, argv[2], &i);
-        int type = lua_geti(res->L, idx, i);
-        return ok_type_tuple(env, res->L, type);
+        if(!has_metatable(res->L, idx) && compat_rawindex(i)) {
+            return ok_type_tuple(env, res->L, lua_rawgeti(res->L, idx, i));
+        } else {
+            guard_t g = {OP_GETI};
+            g.i = (lua_Integer)i;
+            if(guarded(env, res->L, &g, idx, 0, &error) < 0) return error;
+            return ok_type_tuple(env, res->L, lua_type(res->L, -1));
+        }
     } else {
-        return nif_niferror(env, typename(res->L, lua_type(res->L, idx)));
+        return nif_niferror(env, "%s", typename(res->L, lua_type(res->L, idx)));
     }
 }
 
@@ -458,52 +810,53 @@ static ERL_NIF_TERM
 nif_rawget(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
     GET_RESOURCE(env, args, argv);
     int idx;
-    enif_get_int(env, argv[1], &idx);
+    GET_INDEX(env, res->L, argv[1], idx, valid_index);
+    CHECK_TOP(env, res->L, 1);
     if(lua_istable(res->L, idx)) {
         int type = lua_rawget(res->L, idx);
         return ok_type_tuple(env, res->L, type);
     } else {
-        return nif_niferror(env, typename(res->L, lua_type(res->L, idx)));
+        return nif_niferror(env, "%s", typename(res->L, lua_type(res->L, idx)));
     }
 }
 
 static ERL_NIF_TERM 
 nif_rawgeti(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
     GET_RESOURCE(env, args, argv);
-    int idx, i;
-    enif_get_int(env, argv[1], &idx);
+    int idx;
+    ErlNifSInt64 i;
+    GET_INDEX(env, res->L, argv[1], idx, valid_index);
+    if(!enif_get_int64(env, argv[2], &i) || !compat_rawindex(i)) return enif_make_badarg(env);
+    CHECK_STACK(env, res->L, 1);
     if(lua_istable(res->L, idx)) {
-        enif_get_int(env, argv[2], &i);
         int type = lua_rawgeti(res->L, idx, i);
         return ok_type_tuple(env, res->L, type);
     } else {
-        return nif_niferror(env, typename(res->L, lua_type(res->L, idx)));
+        return nif_niferror(env, "%s", typename(res->L, lua_type(res->L, idx)));
     }
 }
 
 static ERL_NIF_TERM 
 nif_createtable(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
     GET_RESOURCE(env, args, argv);
-    int narr, nrec;
-    enif_get_int(env, argv[1], &narr);
-    enif_get_int(env, argv[2], &nrec);
-    lua_createtable(res->L, narr, nrec);
-    return ATOM_OK;
+    guard_t g = {OP_CREATETABLE};
+    ERL_NIF_TERM error;
+    GET_INT(env, argv[1], g.n1);
+    GET_INT(env, argv[2], g.n2);
+    if(g.n1 < 0 || g.n2 < 0) return enif_make_badarg(env);
+    return guarded(env, res->L, &g, 0, 0, &error) < 0 ? error : ATOM_OK;
 }
 
 static ERL_NIF_TERM 
 nif_newuserdata(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
     GET_RESOURCE(env, args, argv);
     ErlNifBinary bin;
+    ERL_NIF_TERM error;
     if(enif_inspect_binary(env, argv[1], &bin)) {
-        void *p = lua_newuserdata(res->L, bin.size);
-        if(p) {
-            memcpy(p, bin.data, bin.size);
-            return ATOM_OK;
-        } else {
-            return nif_niferror(env, "Not enough memory");
-        }
-        //enif_release_binary(&bin);
+        guard_t g = {OP_NEWUSERDATA};
+        g.str = (const char*)bin.data;
+        g.size = bin.size;
+        return guarded(env, res->L, &g, 0, 0, &error) < 0 ? error : ATOM_OK;
     } else {
         return nif_niferror(env, "Could not get binary");
     }
@@ -513,7 +866,8 @@ static ERL_NIF_TERM
 nif_getmetatable(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
     GET_RESOURCE(env, args, argv);
     int idx, ret;
-    enif_get_int(env, argv[1], &idx);
+    GET_INDEX(env, res->L, argv[1], idx, acceptable_index);
+    CHECK_STACK(env, res->L, 1);
     ret = lua_getmetatable(res->L, idx);
     return enif_make_tuple2(env, ATOM_OK, ret ? ATOM_TRUE : ATOM_FALSE);
 }
@@ -522,12 +876,13 @@ static ERL_NIF_TERM
 nif_getuservalue(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
     GET_RESOURCE(env, args, argv);
     int idx;
-    enif_get_int(env, argv[1], &idx);
+    GET_INDEX(env, res->L, argv[1], idx, valid_index);
+    CHECK_STACK(env, res->L, 1);
     if(lua_isuserdata(res->L, idx)) {
         int type = lua_getuservalue(res->L, idx);
         return ok_type_tuple(env, res->L, type);
     } else {
-        return nif_niferror(env, typename(res->L, lua_type(res->L, idx)));
+        return nif_niferror(env, "%s", typename(res->L, lua_type(res->L, idx)));
     }
 }
 
@@ -535,11 +890,17 @@ static ERL_NIF_TERM
 nif_setglobal(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
     GET_RESOURCE(env, args, argv);
     size_t size;
-    char *str = decode_string(env, argv[1], &size);
+    ERL_NIF_TERM error;
+    char *str;
+    CHECK_TOP(env, res->L, 1);
+    str = decode_string(env, argv[1], &size);
     if(str) {
-        lua_setglobal(res->L, str);
+        guard_t g = {OP_SETGLOBAL};
+        int ret;
+        g.str = str;
+        ret = guarded(env, res->L, &g, 0, 1, &error);
         free(str);
-        return ATOM_OK;
+        return ret < 0 ? error : ATOM_OK;
     } else {
         return enif_make_tuple2(env, ATOM_ERROR, ATOM_NULL);
     }
@@ -549,12 +910,14 @@ static ERL_NIF_TERM
 nif_settable(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
     GET_RESOURCE(env, args, argv);
     int idx;
-    enif_get_int(env, argv[1], &idx);
+    ERL_NIF_TERM error;
+    GET_INDEX(env, res->L, argv[1], idx, valid_index);
+    CHECK_TOP(env, res->L, 2);
     if(lua_istable(res->L, idx)) {
-        lua_settable(res->L, idx);
-        return ATOM_OK;
+        guard_t g = {OP_SETTABLE};
+        return guarded(env, res->L, &g, idx, 2, &error) < 0 ? error : ATOM_OK;
     } else {
-        return nif_niferror(env, typename(res->L, lua_type(res->L, idx)));
+        return nif_niferror(env, "%s", typename(res->L, lua_type(res->L, idx)));
     }
 }
 
@@ -562,33 +925,42 @@ static ERL_NIF_TERM
 nif_setfield(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
     GET_RESOURCE(env, args, argv);
     int idx;
-    enif_get_int(env, argv[1], &idx);
+    ERL_NIF_TERM error;
+    GET_INDEX(env, res->L, argv[1], idx, valid_index);
+    CHECK_TOP(env, res->L, 1);
     if(lua_istable(res->L, idx)) {
         size_t size;
         char *str = decode_string(env, argv[2], &size);
         if(str) {
-            lua_setfield(res->L, idx, str);
+            guard_t g = {OP_SETFIELD};
+            int ret;
+            g.str = str;
+            ret = guarded(env, res->L, &g, idx, 1, &error);
             free(str);
-            return ATOM_OK;
+            return ret < 0 ? error : ATOM_OK;
         } else {
             return enif_make_tuple2(env, ATOM_ERROR, ATOM_NULL);
         }
     } else {
-        return nif_niferror(env, typename(res->L, lua_type(res->L, idx)));
+        return nif_niferror(env, "%s", typename(res->L, lua_type(res->L, idx)));
     }
 }
 
 static ERL_NIF_TERM 
 nif_seti(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
     GET_RESOURCE(env, args, argv);
-    int idx, i;
-    enif_get_int(env, argv[1], &idx);
+    int idx;
+    ErlNifSInt64 i;
+    ERL_NIF_TERM error;
+    GET_INDEX(env, res->L, argv[1], idx, valid_index);
+    if(!enif_get_int64(env, argv[2], &i)) return enif_make_badarg(env);
+    CHECK_TOP(env, res->L, 1);
     if(lua_istable(res->L, idx)) {
-        enif_get_int(env, argv[2], &i);
-        lua_seti(res->L, idx, i);
-        return ATOM_OK;
+        guard_t g = {OP_SETI};
+        g.i = (lua_Integer)i;
+        return guarded(env, res->L, &g, idx, 1, &error) < 0 ? error : ATOM_OK;
     } else {
-        return nif_niferror(env, typename(res->L, lua_type(res->L, idx)));
+        return nif_niferror(env, "%s", typename(res->L, lua_type(res->L, idx)));
     }
 }
 
@@ -596,26 +968,33 @@ static ERL_NIF_TERM
 nif_rawset(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
     GET_RESOURCE(env, args, argv);
     int idx;
-    enif_get_int(env, argv[1], &idx);
+    ERL_NIF_TERM error;
+    GET_INDEX(env, res->L, argv[1], idx, valid_index);
+    CHECK_TOP(env, res->L, 2);
     if(lua_istable(res->L, idx)) {
-        lua_rawset(res->L, idx);
-        return ATOM_OK;
+        /* Raises an error for a nil or NaN key */
+        guard_t g = {OP_RAWSET};
+        return guarded(env, res->L, &g, idx, 2, &error) < 0 ? error : ATOM_OK;
     } else {
-        return nif_niferror(env, typename(res->L, lua_type(res->L, idx)));
+        return nif_niferror(env, "%s", typename(res->L, lua_type(res->L, idx)));
     }
 }
 
 static ERL_NIF_TERM 
 nif_rawseti(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
     GET_RESOURCE(env, args, argv);
-    int idx, i;
-    enif_get_int(env, argv[1], &idx);
+    int idx;
+    ErlNifSInt64 i;
+    ERL_NIF_TERM error;
+    GET_INDEX(env, res->L, argv[1], idx, valid_index);
+    if(!enif_get_int64(env, argv[2], &i) || !compat_rawindex(i)) return enif_make_badarg(env);
+    CHECK_TOP(env, res->L, 1);
     if(lua_istable(res->L, idx)) {
-        enif_get_int(env, argv[2], &i);
-        lua_rawseti(res->L, idx, i);
-        return ATOM_OK;
+        guard_t g = {OP_RAWSETI};
+        g.i = (lua_Integer)i;
+        return guarded(env, res->L, &g, idx, 1, &error) < 0 ? error : ATOM_OK;
     } else {
-        return nif_niferror(env, typename(res->L, lua_type(res->L, idx)));
+        return nif_niferror(env, "%s", typename(res->L, lua_type(res->L, idx)));
     }
 }
 
@@ -623,7 +1002,9 @@ static ERL_NIF_TERM
 nif_setmetatable(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
     GET_RESOURCE(env, args, argv);
     int idx, ret;
-    enif_get_int(env, argv[1], &idx);
+    GET_INDEX(env, res->L, argv[1], idx, valid_index);
+    CHECK_TOP(env, res->L, 1);
+    if(!lua_istable(res->L, -1) && !lua_isnil(res->L, -1)) return enif_make_badarg(env);
     ret = lua_setmetatable(res->L, idx);
     return enif_make_tuple2(env, ATOM_OK, ret ? ATOM_TRUE : ATOM_FALSE);
 }
@@ -632,30 +1013,42 @@ static ERL_NIF_TERM
 nif_setuservalue(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
     GET_RESOURCE(env, args, argv);
     int idx;
-    enif_get_int(env, argv[1], &idx);
+    GET_INDEX(env, res->L, argv[1], idx, valid_index);
+    CHECK_TOP(env, res->L, 1);
     if(lua_isuserdata(res->L, idx)) {
         lua_setuservalue(res->L, idx);
         return ATOM_OK;
     } else {
-        return nif_niferror(env, typename(res->L, lua_type(res->L, idx)));
+        return nif_niferror(env, "%s", typename(res->L, lua_type(res->L, idx)));
     }
 }
 
+/*
+ * Check the arguments of lua_pcall: the function and nargs arguments are on the stack
+ * and there is the space for nres results
+ */
+static int
+valid_call(lua_State *L, int nargs, int nres) {
+    return nargs >= 0 && nres >= LUA_MULTRET && lua_gettop(L) > nargs
+        && lua_checkstack(L, nres > nargs ? nres - nargs : 0);
+}
+
 static ERL_NIF_TERM 
 nif_pcall(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
     GET_RESOURCE(env, args, argv);
     ERL_NIF_TERM nif_ret;
     int nargs, nres, ret;
-    enif_get_int(env, argv[1], &nargs);
-    enif_get_int(env, argv[2], &nres);
+    GET_INT(env, argv[1], nargs);
+    GET_INT(env, argv[2], nres);
+    if(!valid_call(res->L, nargs, nres)) return enif_make_badarg(env);
     //ret = lua_resume(res->L, 0, nargs);
     ret = lua_pcall(res->L, nargs, nres, 0);
     if(ret == LUA_OK) {
         nif_ret = ATOM_OK;
-    } else if(LUA_YIELD) {
+    } else if(ret == LUA_YIELD) {
         nif_ret = ATOM_YIELD;
     } else if(lua_isstring(res->L, -1)) {
-        nif_ret = nif_niferror(env, lua_tostring(res->L, -1));
+        nif_ret = nif_niferror(env, "%s", lua_tostring(res->L, -1));
         lua_pop(res->L, 1);
     } else {
         nif_ret = enif_make_tuple2(env, ATOM_ERROR, enif_make_int(env, ret));
@@ -663,19 +1056,83 @@ nif_pcall(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
     return nif_ret;
 }
 
+static const char TRACEBACK_KEY = 't';
+
+/*
+ * Message handler which keeps the error object as is and saves the traceback into the registry
+ */
+static int
+traceback_handler(lua_State *L) {
+    luaL_traceback(L, L, NULL, 1);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &TRACEBACK_KEY);
+    return 1;
+}
+
+static const char*
+error_kind(int status) {
+    switch(status) {
+        case LUA_ERRRUN: return "runtime";
+        case LUA_ERRSYNTAX: return "syntax";
+        case LUA_ERRMEM: return "memory";
+        case LUA_ERRERR: return "handler";
+        default: return "gc";
+    }
+}
+
+/*
+ * Pop the error object from the stack and make {error, {Kind, Reason, Traceback}} tuple.
+ * Reason is the error object converted to the Erlang term (string errors become binaries),
+ * Traceback is the binary saved by traceback_handler or an empty binary
+ */
+static ERL_NIF_TERM
+structured_error(ErlNifEnv *env, lua_State *L, int status) {
+    ERL_NIF_TERM reason, traceback;
+    if(!get_term(env, L, -1, 0, &reason)) reason = ATOM_NULL;
+    lua_pop(L, 1);
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &TRACEBACK_KEY);
+    if(lua_type(L, -1) != LUA_TSTRING || !get_term(env, L, -1, 0, &traceback)) {
+        enif_make_new_binary(env, 0, &traceback);
+    }
+    lua_pop(L, 1);
+    lua_pushnil(L);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &TRACEBACK_KEY);
+    return enif_make_tuple2(env, ATOM_ERROR, enif_make_tuple3(env, ATOM(error_kind(status)), reason, traceback));
+}
+
+static ERL_NIF_TERM 
+nif_pcall_ex(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
+    GET_RESOURCE(env, args, argv);
+    int nargs, nres, traceback, base = 0, ret;
+    GET_INT(env, argv[1], nargs);
+    GET_INT(env, argv[2], nres);
+    GET_INT(env, argv[3], traceback);
+    if(!valid_call(res->L, nargs, nres)) return enif_make_badarg(env);
+    CHECK_STACK(env, res->L, 1);
+    if(traceback) {
+        base = lua_gettop(res->L) - nargs;
+        lua_pushcfunction(res->L, traceback_handler);
+        lua_insert(res->L, base);
+    }
+    ret = lua_pcall(res->L, nargs, nres, base);
+    if(base) lua_remove(res->L, base);
+    return ret == LUA_OK ? ATOM_OK : structured_error(env, res->L, ret);
+}
+
 static ERL_NIF_TERM 
 nif_loadbuffer(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
     GET_RESOURCE(env, args, argv);
     size_t size1, size2;
     ERL_NIF_TERM nif_ret;
-    char *chunk = decode_string(env, argv[1], &size1);
-    char *name = decode_string(env, argv[2], &size2);
+    char *chunk, *name;
+    CHECK_STACK(env, res->L, 1);
+    chunk = decode_string(env, argv[1], &size1);
+    name = decode_string(env, argv[2], &size2);
     if(chunk && name) {
         int ret = luaL_loadbuffer(res->L, chunk, size1, size2 > 0 ? name : NULL);
         if(ret == LUA_OK) {
             nif_ret = ATOM_OK;
         } else if(lua_isstring(res->L, -1)) {
-            nif_ret = nif_niferror(env, lua_tostring(res->L, -1));
+            nif_ret = nif_niferror(env, "%s", lua_tostring(res->L, -1));
             lua_pop(res->L, 1);
         } else {
             nif_ret = enif_make_tuple2(env, ATOM_ERROR, enif_make_int(env, ret));
@@ -693,14 +1150,16 @@ nif_loadfile(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
     GET_RESOURCE(env, args, argv);
     size_t size;
     ERL_NIF_TERM nif_ret;
-    char *filename = decode_string(env, argv[1], &size);
+    char *filename;
+    CHECK_STACK(env, res->L, 1);
+    filename = decode_string(env, argv[1], &size);
     if(filename) {
         int ret = luaL_loadfile(res->L, filename);
         free(filename);
         if(ret == LUA_OK) {
             nif_ret = ATOM_OK;
         } else if(lua_isstring(res->L, -1)) {
-            nif_ret = nif_niferror(env, lua_tostring(res->L, -1));
+            nif_ret = nif_niferror(env, "%s", lua_tostring(res->L, -1));
             lua_pop(res->L, 1);
         } else {
             nif_ret = enif_make_tuple2(env, ATOM_ERROR, enif_make_int(env, ret));
@@ -711,7 +1170,7 @@ nif_loadfile(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
     return nif_ret;
 }
 
-static int lua_writer(lua_State *L, const void *p, size_t size, void *ud) {
+int lua_writer(lua_State *L, const void *p, size_t size, void *ud) {
     writer_t *w = (writer_t*)ud;
     int block_size = 512, avail;
     if(!w->bin) {
@@ -738,7 +1197,12 @@ nif_dump(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
     ERL_NIF_TERM nif_ret;
     ErlNifBinary bin;
     int strip;
-    enif_get_int(env, argv[1], &strip);
+    GET_INT(env, argv[1], strip);
+    CHECK_TOP(env, res->L, 1);
+    /* lua_dump pushes nothing on failure, the value on the top belongs to the caller */
+    if(lua_type(res->L, -1) != LUA_TFUNCTION) {
+        return nif_niferror(env, "%s", typename(res->L, lua_type(res->L, -1)));
+    }
     int ret = lua_dump(res->L, &lua_writer, &wrt, strip);
     if(!ret) {
         if(enif_alloc_binary(wrt.cur, &bin)) {
@@ -747,9 +1211,6 @@ nif_dump(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
         } else {
             nif_ret = enif_make_tuple2(env, ATOM_ERROR, ATOM_NULL);
         }
-    } else if(lua_isstring(res->L, -1)) {
-        nif_ret = nif_niferror(env, lua_tostring(res->L, -1));
-        lua_pop(res->L, 1);
     } else {
         nif_ret = enif_make_tuple2(env, ATOM_ERROR, enif_make_int(env, ret));
     }
@@ -760,11 +1221,19 @@ nif_dump(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
 static ERL_NIF_TERM 
 nif_gc(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
     GET_RESOURCE(env, args, argv);
-    int what, data, ret;
-    enif_get_int(env, argv[1], &what);
-    enif_get_int(env, argv[2], &data);
-    ret = lua_gc(res->L, what, data);
-    switch(what) {
+    guard_t g = {OP_GC};
+    ERL_NIF_TERM error;
+    lua_Integer ret;
+    GET_INT(env, argv[1], g.n1);
+    GET_INT(env, argv[2], g.n2);
+    if(g.n1 < LUA_GCSTOP || (g.n1 > LUA_GCSETSTEPMUL && g.n1 != LUA_GCISRUNNING)) {
+        return enif_make_badarg(env);
+    }
+    /* A full collection runs the finalizers, which may fail */
+    if(guarded(env, res->L, &g, 0, 0, &error) < 0) return error;
+    ret = lua_tointeger(res->L, -1);
+    lua_pop(res->L, 1);
+    switch(g.n1) {
         case LUA_GCSTOP:
         case LUA_GCRESTART:
         case LUA_GCCOLLECT:
@@ -775,106 +1244,317 @@ nif_gc(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
             return enif_make_tuple2(env, ATOM_OK, ret ? ATOM_TRUE : ATOM_FALSE);
             
         default:    
-            return enif_make_tuple2(env, ATOM_OK, enif_make_int(env, ret));
+            return enif_make_tuple2(env, ATOM_OK, enif_make_int(env, (int)ret));
     }
 }
 
+/*
+ * Raise the error with the value on the top of the stack as the error object.
+ * The error is caught by the guard, the value is popped and returned as {error, Reason}
+ */
 static ERL_NIF_TERM 
 nif_error(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
     GET_RESOURCE(env, args, argv);
-    lua_error(res->L);
-    return ATOM_OK;
+    guard_t g = {OP_ERROR};
+    ERL_NIF_TERM error;
+    CHECK_TOP(env, res->L, 1);
+    guarded(env, res->L, &g, 0, 1, &error);
+    lua_pop(res->L, 1);
+    return error;
 }
 
 static ERL_NIF_TERM 
 nif_next(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
     GET_RESOURCE(env, args, argv);
     int idx, ret;
-    enif_get_int(env, argv[1], &idx);
-    ret = lua_next(res->L, idx);
-    return enif_make_tuple2(env, ATOM_OK, ret ? ATOM_TRUE : ATOM_FALSE);
+    ERL_NIF_TERM error;
+    GET_INDEX(env, res->L, argv[1], idx, valid_index);
+    CHECK_TOP(env, res->L, 1);
+    if(lua_istable(res->L, idx)) {
+        /* Raises an error for a key which is not in the table */
+        guard_t g = {OP_NEXT};
+        if((ret = guarded(env, res->L, &g, idx, 1, &error)) < 0) return error;
+        return enif_make_tuple2(env, ATOM_OK, ret ? ATOM_TRUE : ATOM_FALSE);
+    } else {
+        return nif_niferror(env, "%s", typename(res->L, lua_type(res->L, idx)));
+    }
 }
 
 static ERL_NIF_TERM 
 nif_concat(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
     GET_RESOURCE(env, args, argv);
-    int n;
-    enif_get_int(env, argv[1], &n);
-    lua_concat(res->L, n);
-    return ATOM_OK;
+    guard_t g = {OP_CONCAT};
+    ERL_NIF_TERM error;
+    GET_INT(env, argv[1], g.n1);
+    CHECK_TOP(env, res->L, g.n1);
+    if(g.n1 == 1) return ATOM_OK;
+    return guarded(env, res->L, &g, 0, g.n1, &error) < 0 ? error : ATOM_OK;
 }
 
 static ERL_NIF_TERM 
 nif_len(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
     GET_RESOURCE(env, args, argv);
-    int idx;
-    enif_get_int(env, argv[1], &idx);
-    lua_len(res->L, idx);
+    int idx, type;
+    ERL_NIF_TERM error;
+    GET_INDEX(env, res->L, argv[1], idx, valid_index);
+    CHECK_STACK(env, res->L, 1);
+    type = lua_type(res->L, idx);
+    if(type == LUA_TSTRING || (type == LUA_TTABLE && !has_metatable(res->L, idx))) {
+        lua_pushinteger(res->L, (lua_Integer)lua_rawlen(res->L, idx));
+    } else {
+        guard_t g = {OP_LEN};
+        if(guarded(env, res->L, &g, idx, 0, &error) < 0) return error;
+    }
     return ATOM_OK;
 }
 
+/*
+ * Take the timers requested by erlang.timer and erlang.sleep since the last call
+ */
+static ERL_NIF_TERM
+nif_timers(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
+    GET_RESOURCE(env, args, argv);
+    guard_t g = {OP_TIMERS};
+    ERL_NIF_TERM error;
+    CHECK_STACK(env, res->L, 1);
+    g.env = env;
+    if(guarded(env, res->L, &g, 0, 0, &error) < 0) return error;
+    return g.term;
+}
+
+static ERL_NIF_TERM
+nif_fire_timer(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
+    GET_RESOURCE(env, args, argv);
+    guard_t g = {OP_FIRE_TIMER};
+    ErlNifSInt64 id;
+    ERL_NIF_TERM error;
+    if(!enif_get_int64(env, argv[1], &id)) return enif_make_badarg(env);
+    CHECK_STACK(env, res->L, 1);
+    g.env = env;
+    g.i = (lua_Integer)id;
+    if(guarded(env, res->L, &g, 0, 0, &error) < 0) return error;
+    return g.term;
+}
+
+/*
+ * Push the shared data created by newshared as a read-only userdata
+ */
+static ERL_NIF_TERM
+nif_pushshared(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
+    GET_RESOURCE(env, args, argv);
+    guard_t g = {OP_PUSHSHARED};
+    ERL_NIF_TERM error;
+    CHECK_STACK(env, res->L, 1);
+    g.env = env;
+    g.term = argv[1];
+    if(guarded(env, res->L, &g, 0, 0, &error) < 0) return error;
+    if(!g.n1) return enif_make_badarg(env);
+    return ATOM_OK;
+}
+
+/*
+ * Start logging every call made on the state into the given file
+ */
+static ERL_NIF_TERM
+nif_record(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
+    GET_RESOURCE(env, args, argv);
+    size_t size;
+    char *filename;
+    recorder_t *r = NULL;
+    int busy;
+    if(!(filename = decode_string(env, argv[1], &size))) return enif_make_badarg(env);
+    enif_mutex_lock(res->lock);
+    if(!(busy = res->recorder != NULL)) r = res->recorder = recorder_start(filename);
+    enif_mutex_unlock(res->lock);
+    free(filename);
+    if(busy) return nif_niferror(env, "The state is already being recorded");
+    return r ? ATOM_OK : nif_niferror(env, "Could not start the recorder");
+}
+
+static ERL_NIF_TERM
+nif_stop_recording(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
+    GET_RESOURCE(env, args, argv);
+    recorder_t *r = take_recorder(res);
+    int ok = r ? recorder_stop(r) : 1;
+    return ok ? ATOM_OK : nif_niferror(env, "Could not write the recording");
+}
+
+/*
+ * Wrap a state operation to log its calls while the state is being recorded
+ */
+static ERL_NIF_TERM
+record_call(ErlNifEnv *env, const char *op, ERL_NIF_TERM (*fun)(ErlNifEnv*, int, const ERL_NIF_TERM[]),
+        int args, const ERL_NIF_TERM argv[]) {
+    res_t *res;
+    ErlNifTime start;
+    ERL_NIF_TERM ret;
+    int recording;
+    if(!RECORDERS || !args || !enif_get_resource(env, argv[0], LUA_RESOURCE, (void**)&res)) {
+        return fun(env, args, argv);
+    }
+    enif_mutex_lock(res->lock);
+    recording = res->recorder != NULL;
+    enif_mutex_unlock(res->lock);
+    if(!recording) return fun(env, args, argv);
+
+    start = enif_monotonic_time(ERL_NIF_NSEC);
+    ret = fun(env, args, argv);
+    /* The recorder may have been stopped meanwhile, it is not freed while the lock is held */
+    enif_mutex_lock(res->lock);
+    if(res->recorder) {
+        recorder_log(res->recorder, env, op, args, argv, start, enif_monotonic_time(ERL_NIF_NSEC) - start);
+    }
+    enif_mutex_unlock(res->lock);
+    return ret;
+}
+
+#define RECORDED(op, fun) \
+    static ERL_NIF_TERM fun##_rec(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) { \
+        return record_call(env, op, fun, args, argv); \
+    }
+
+RECORDED("version", nif_version)
+RECORDED("absindex", nif_absindex)
+RECORDED("gettop", nif_gettop)
+RECORDED("settop", nif_settop)
+RECORDED("pushvalue", nif_pushvalue)
+RECORDED("rotate", nif_rotate)
+RECORDED("copy", nif_copy)
+RECORDED("checkstack", nif_checkstack)
+RECORDED("isnumber", nif_isnumber)
+RECORDED("isinteger", nif_isinteger)
+RECORDED("isstring", nif_isstring)
+RECORDED("iscfunction", nif_iscfunction)
+RECORDED("isuserdata", nif_isuserdata)
+RECORDED("islightuserdata", nif_islightuserdata)
+RECORDED("type", nif_type)
+RECORDED("tonumber", nif_tonumber)
+RECORDED("tointeger", nif_tointeger)
+RECORDED("tonumber_raw", nif_tonumber_raw)
+RECORDED("tointeger_raw", nif_tointeger_raw)
+RECORDED("tonumbers", nif_tonumbers)
+RECORDED("tointegers", nif_tointegers)
+RECORDED("toboolean", nif_toboolean)
+RECORDED("tostring", nif_tostring)
+RECORDED("touserdata", nif_touserdata)
+RECORDED("rawlen", nif_rawlen)
+RECORDED("rawequal", nif_rawequal)
+RECORDED("compare", nif_compare)
+RECORDED("pushnil", nif_pushnil)
+RECORDED("pushinteger", nif_pushinteger)
+RECORDED("pushnumber", nif_pushnumber)
+RECORDED("pushstring", nif_pushstring)
+RECORDED("pushboolean", nif_pushboolean)
+RECORDED("getglobal", nif_getglobal)
+RECORDED("gettable", nif_gettable)
+RECORDED("getfield", nif_getfield)
+RECORDED("geti", nif_geti)
+RECORDED("rawget", nif_rawget)
+RECORDED("rawgeti", nif_rawgeti)
+RECORDED("createtable", nif_createtable)
+RECORDED("newuserdata", nif_newuserdata)
+RECORDED("getmetatable", nif_getmetatable)
+RECORDED("getuservalue", nif_getuservalue)
+RECORDED("setglobal", nif_setglobal)
+RECORDED("settable", nif_settable)
+RECORDED("setfield", nif_setfield)
+RECORDED("seti", nif_seti)
+RECORDED("rawset", nif_rawset)
+RECORDED("rawseti", nif_rawseti)
+RECORDED("setmetatable", nif_setmetatable)
+RECORDED("setuservalue", nif_setuservalue)
+RECORDED("pcall", nif_pcall)
+RECORDED("pcall", nif_pcall_ex)
+RECORDED("loadbuffer", nif_loadbuffer)
+RECORDED("loadfile", nif_loadfile)
+RECORDED("dump", nif_dump)
+RECORDED("gc", nif_gc)
+RECORDED("error", nif_error)
+RECORDED("next", nif_next)
+RECORDED("concat", nif_concat)
+RECORDED("len", nif_len)
+RECORDED("timers", nif_timers)
+RECORDED("fire_timer", nif_fire_timer)
+RECORDED("pushshared", nif_pushshared)
+
 
 static ErlNifFunc nif_funcs[] = {
     {"newstate",        0, nif_newstate},
+    {"newstate",        1, nif_newstate},
     {"close",           1, nif_close},
-    {"version",         1, nif_version},
-    {"absindex",        2, nif_absindex},
-    {"gettop",          1, nif_gettop},
-    {"settop",          2, nif_settop},
-    {"pushvalue",       2, nif_pushvalue},
-    {"rotate",          3, nif_rotate},
-    {"copy",            3, nif_copy},
-    {"checkstack",      2, nif_checkstack},
-    {"isnumber",        2, nif_isnumber},
-    {"isinteger",       2, nif_isinteger},
-    {"isstring",        2, nif_isstring},
-    {"iscfunction",     2, nif_iscfunction},
-    {"isuserdata",      2, nif_isuserdata},
-    {"islightuserdata", 2, nif_islightuserdata},
-    {"type",            2, nif_type},
-    {"tonumber",        2, nif_tonumber},
-    {"tointeger",       2, nif_tointeger},
-    {"toboolean",       2, nif_toboolean},
-    {"tostring",        2, nif_tostring},
-    {"touserdata",      2, nif_touserdata},
-    {"rawlen",          2, nif_rawlen},
-    {"rawequal",        3, nif_rawequal},
-    {"compare",         4, nif_compare},
-    {"pushnil",         1, nif_pushnil},
-    {"pushinteger",     2, nif_pushinteger},
-    {"pushnumber",      2, nif_pushnumber},
-    {"pushstring",      2, nif_pushstring},
-    {"pushboolean",     2, nif_pushboolean},
-    {"getglobal",       2, nif_getglobal},
-    {"gettable",        2, nif_gettable},
-    {"getfield",        3, nif_getfield},
-    {"geti",            3, nif_geti},
-    {"rawget",          2, nif_rawget},
-    {"rawgeti",         3, nif_rawgeti},
-    {"createtable",     3, nif_createtable},
-    {"newuserdata",     2, nif_newuserdata},
-    {"getmetatable",    2, nif_getmetatable},
-    {"getuservalue",    2, nif_getuservalue},
-    {"setglobal",       2, nif_setglobal},
-    {"settable",        2, nif_settable},
-    {"setfield",        3, nif_setfield},
-    {"seti",            3, nif_seti},
-    {"rawset",          2, nif_rawset},
-    {"rawseti",         3, nif_rawseti},
-    {"setmetatable",    2, nif_setmetatable},
-    {"setuservalue",    2, nif_setuservalue},
-    {"pcall",           3, nif_pcall},
-    {"loadbuffer",      3, nif_loadbuffer},
-    {"loadfile",        2, nif_loadfile},
-    {"dump",            2, nif_dump},
-    {"gc",              3, nif_gc},
-    {"error",           1, nif_error},
-    {"next",            2, nif_next},
-    {"concat",          2, nif_concat},
-    {"len",             2, nif_len},
+    {"version",         1, nif_version_rec},
+    {"absindex",        2, nif_absindex_rec},
+    {"gettop",          1, nif_gettop_rec},
+    {"settop",          2, nif_settop_rec},
+    {"pushvalue",       2, nif_pushvalue_rec},
+    {"rotate",          3, nif_rotate_rec},
+    {"copy",            3, nif_copy_rec},
+    {"checkstack",      2, nif_checkstack_rec},
+    {"isnumber",        2, nif_isnumber_rec},
+    {"isinteger",       2, nif_isinteger_rec},
+    {"isstring",        2, nif_isstring_rec},
+    {"iscfunction",     2, nif_iscfunction_rec},
+    {"isuserdata",      2, nif_isuserdata_rec},
+    {"islightuserdata", 2, nif_islightuserdata_rec},
+    {"type",            2, nif_type_rec},
+    {"tonumber",        2, nif_tonumber_rec},
+    {"tointeger",       2, nif_tointeger_rec},
+    {"tonumber_raw",    2, nif_tonumber_raw_rec},
+    {"tointeger_raw",   2, nif_tointeger_raw_rec},
+    {"tonumbers",       2, nif_tonumbers_rec},
+    {"tointegers",      2, nif_tointegers_rec},
+    {"toboolean",       2, nif_toboolean_rec},
+    {"tostring",        2, nif_tostring_rec},
+    {"touserdata",      2, nif_touserdata_rec},
+    {"rawlen",          2, nif_rawlen_rec},
+    {"rawequal",        3, nif_rawequal_rec},
+    {"compare",         4, nif_compare_rec},
+    {"pushnil",         1, nif_pushnil_rec},
+    {"pushinteger",     2, nif_pushinteger_rec},
+    {"pushnumber",      2, nif_pushnumber_rec},
+    {"pushstring",      2, nif_pushstring_rec},
+    {"pushboolean",     2, nif_pushboolean_rec},
+    {"getglobal",       2, nif_getglobal_rec},
+    {"gettable",        2, nif_gettable_rec},
+    {"getfield",        3, nif_getfield_rec},
+    {"geti",            3, nif_geti_rec},
+    {"rawget",          2, nif_rawget_rec},
+    {"rawgeti",         3, nif_rawgeti_rec},
+    {"createtable",     3, nif_createtable_rec},
+    {"newuserdata",     2, nif_newuserdata_rec},
+    {"getmetatable",    2, nif_getmetatable_rec},
+    {"getuservalue",    2, nif_getuservalue_rec},
+    {"setglobal",       2, nif_setglobal_rec},
+    {"settable",        2, nif_settable_rec},
+    {"setfield",        3, nif_setfield_rec},
+    {"seti",            3, nif_seti_rec},
+    {"rawset",          2, nif_rawset_rec},
+    {"rawseti",         3, nif_rawseti_rec},
+    {"setmetatable",    2, nif_setmetatable_rec},
+    {"setuservalue",    2, nif_setuservalue_rec},
+    {"pcall",           3, nif_pcall_rec},
+    {"pcall",           4, nif_pcall_ex_rec},
+    {"loadbuffer",      3, nif_loadbuffer_rec},
+    {"loadfile",        2, nif_loadfile_rec},
+    {"dump",            2, nif_dump_rec},
+    {"gc",              3, nif_gc_rec},
+    {"error",           1, nif_error_rec},
+    {"next",            2, nif_next_rec},
+    {"concat",          2, nif_concat_rec},
+    {"len",             2, nif_len_rec},
+    {"timers",          1, nif_timers_rec},
+    {"fire_timer",      2, nif_fire_timer_rec},
+    {"newshared",       1, nif_newshared, DIRTY_CPU},
+    {"pushshared",      2, nif_pushshared_rec},
+    {"record",          2, nif_record},
+    {"stop_recording",  1, nif_stop_recording},
+    {"pmap",            3, nif_pmap, DIRTY_CPU},
+    {"register_module", 2, nif_register_module, DIRTY_CPU},
+    {"unregister_module", 1, nif_unregister_module},
+    {"registered_modules", 0, nif_registered_modules},
 };
 
-ERL_NIF_INIT(erlylua_nif, nif_funcs, nif_load, NULL, NULL, NULL);
+ERL_NIF_INIT(erlylua_nif, nif_funcs, nif_load, NULL, NULL, nif_unload);
 
 
 
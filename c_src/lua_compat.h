@@ -0,0 +1,203 @@
+#ifndef LUA_COMPAT_H
+#define LUA_COMPAT_H
+
+/*
+ * The NIF is written against the Lua 5.3 API. This header maps the parts of it
+ * which differ in Lua 5.4 and LuaJIT 2.1 (the Lua 5.1 API with a few 5.2 extensions)
+ */
+
+#include <limits.h>
+#include <stdint.h>
+#include <lua.h>
+#include <lauxlib.h>
+
+/* The Lua version number as a number, i.e. 503 */
+#if LUA_VERSION_NUM >= 504
+#define compat_version(L) lua_version(L)
+#elif LUA_VERSION_NUM >= 502
+#define compat_version(L) (*lua_version(L))
+#else
+#define compat_version(L) ((lua_Number)LUA_VERSION_NUM)
+#endif
+
+/* Whether n fits the index of lua_rawgeti and lua_rawseti, which is an int in 5.1 */
+#if LUA_VERSION_NUM >= 502
+#define compat_rawindex(n) 1
+#else
+#define compat_rawindex(n) ((n) >= INT_MIN && (n) <= INT_MAX)
+#endif
+
+/* The name of package.searchers */
+#if LUA_VERSION_NUM >= 502
+#define LUA_SEARCHERS "searchers"
+#else
+#define LUA_SEARCHERS "loaders"
+#endif
+
+
+#if LUA_VERSION_NUM >= 504
+
+/* 5.4 returns the number of results in an extra argument */
+static inline int
+compat_resume(lua_State *L, lua_State *from, int nargs) {
+    int nres;
+    return lua_resume(L, from, nargs, &nres);
+}
+#define lua_resume compat_resume
+
+#endif
+
+
+#if LUA_VERSION_NUM == 501
+
+#ifndef LUA_OK
+#define LUA_OK 0
+#endif
+#ifndef LUA_GCISRUNNING
+#define LUA_GCISRUNNING 9
+#endif
+#ifndef LUA_OPEQ
+#define LUA_OPEQ 0
+#define LUA_OPLT 1
+#define LUA_OPLE 2
+#endif
+
+#define lua_rawlen(L, idx) lua_objlen(L, idx)
+#define lua_dump(L, writer, data, strip) lua_dump(L, writer, data)
+#define lua_resume(L, from, nargs) lua_resume(L, nargs)
+
+static inline int
+lua_absindex(lua_State *L, int idx) {
+    return idx > 0 || idx <= LUA_REGISTRYINDEX ? idx : lua_gettop(L) + idx + 1;
+}
+
+/* Numbers are doubles in LuaJIT, so a number is an integer if it has no fractional part */
+static inline int
+lua_isinteger(lua_State *L, int idx) {
+    lua_Number n;
+    if(lua_type(L, idx) != LUA_TNUMBER) return 0;
+    n = lua_tonumber(L, idx);
+    return n >= (lua_Number)PTRDIFF_MIN && n < -(lua_Number)PTRDIFF_MIN && n == (lua_Number)(lua_Integer)n;
+}
+
+static inline lua_Integer
+compat_tointegerx(lua_State *L, int idx, int *isnum) {
+    int ok = lua_isinteger(L, idx);
+    if(isnum) *isnum = ok;
+    return ok ? lua_tointeger(L, idx) : 0;
+}
+
+static inline void
+lua_rotate(lua_State *L, int idx, int n) {
+    int size;
+    idx = lua_absindex(L, idx);
+    size = lua_gettop(L) - idx + 1;
+    if(size <= 0) return;
+    n %= size;
+    if(n < 0) n += size;
+    while(n--) {
+        lua_insert(L, idx);
+    }
+}
+
+static inline int
+compat_gettable(lua_State *L, int idx) {
+    lua_gettable(L, idx);
+    return lua_type(L, -1);
+}
+
+static inline int
+compat_getfield(lua_State *L, int idx, const char *k) {
+    lua_getfield(L, idx, k);
+    return lua_type(L, -1);
+}
+
+static inline int
+compat_getglobal(lua_State *L, const char *name) {
+    lua_getfield(L, LUA_GLOBALSINDEX, name);
+    return lua_type(L, -1);
+}
+
+static inline int
+compat_rawget(lua_State *L, int idx) {
+    lua_rawget(L, idx);
+    return lua_type(L, -1);
+}
+
+/* n must satisfy compat_rawindex */
+static inline int
+compat_rawgeti(lua_State *L, int idx, lua_Integer n) {
+    lua_rawgeti(L, idx, (int)n);
+    return lua_type(L, -1);
+}
+
+static inline int
+lua_geti(lua_State *L, int idx, lua_Integer n) {
+    idx = lua_absindex(L, idx);
+    lua_pushinteger(L, n);
+    lua_gettable(L, idx);
+    return lua_type(L, -1);
+}
+
+static inline void
+lua_seti(lua_State *L, int idx, lua_Integer n) {
+    idx = lua_absindex(L, idx);
+    lua_pushinteger(L, n);
+    lua_insert(L, -2);
+    lua_settable(L, idx);
+}
+
+static inline int
+lua_rawgetp(lua_State *L, int idx, const void *p) {
+    idx = lua_absindex(L, idx);
+    lua_pushlightuserdata(L, (void*)p);
+    lua_rawget(L, idx);
+    return lua_type(L, -1);
+}
+
+static inline void
+lua_rawsetp(lua_State *L, int idx, const void *p) {
+    idx = lua_absindex(L, idx);
+    lua_pushlightuserdata(L, (void*)p);
+    lua_insert(L, -2);
+    lua_rawset(L, idx);
+}
+
+/* User values are the function environments in 5.1 */
+static inline int
+lua_getuservalue(lua_State *L, int idx) {
+    lua_getfenv(L, idx);
+    return lua_type(L, -1);
+}
+
+#define lua_setuservalue(L, idx) lua_setfenv(L, idx)
+
+static inline int
+lua_compare(lua_State *L, int idx1, int idx2, int op) {
+    switch(op) {
+        case LUA_OPEQ: return lua_equal(L, idx1, idx2);
+        case LUA_OPLT: return lua_lessthan(L, idx1, idx2);
+        case LUA_OPLE: return lua_lessthan(L, idx1, idx2) || lua_equal(L, idx1, idx2);
+        default: return 0;
+    }
+}
+
+static inline void
+lua_len(lua_State *L, int idx) {
+    idx = lua_absindex(L, idx);
+    if(!luaL_callmeta(L, idx, "__len")) {
+        lua_pushinteger(L, (lua_Integer)lua_objlen(L, idx));
+    }
+}
+
+#undef lua_getglobal
+#define lua_getglobal compat_getglobal
+#define lua_getfield compat_getfield
+#define lua_gettable compat_gettable
+#define lua_rawget compat_rawget
+#define lua_rawgeti compat_rawgeti
+#define lua_tointegerx compat_tointegerx
+
+#endif
+
+#endif
@@ -0,0 +1,498 @@
+#include <stdlib.h>
+#include <string.h>
+#include <erl_nif.h>
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "erlylua.h"
+
+#define MAX_WORKERS 256
+#define CHUNKS_PER_WORKER 8
+
+
+/*
+ * A range of inputs copied into their own environment. A chunk is taken by one worker,
+ * so no environment is read by several threads
+ */
+typedef struct _pmap_chunk_t {
+    ErlNifEnv *env;
+    unsigned lo;
+    unsigned hi;
+} pmap_chunk_t;
+
+/* A range of chunk indices owned by a worker. Other workers steal from its tail */
+typedef struct _pmap_queue_t {
+    ErlNifMutex *lock;
+    unsigned lo;
+    unsigned hi;
+} pmap_queue_t;
+
+typedef struct _pmap_job_t {
+    const char *chunk;
+    size_t size;
+    ERL_NIF_TERM *inputs;       /* terms of the chunk environments */
+    ERL_NIF_TERM *results;      /* terms of the worker environments */
+    unsigned count;
+    pmap_chunk_t *chunks;
+    unsigned nchunks;
+    unsigned nworkers;
+    pmap_queue_t *queues;
+    ErlNifMutex *lock;
+    ErlNifCond *cond;
+    unsigned running;           /* the workers which have not finished the job yet */
+} pmap_job_t;
+
+/*
+ * A native thread with its own Lua state. Workers are kept in the pool between the calls,
+ * a worker runs one job at a time
+ */
+typedef struct _pmap_worker_t {
+    struct _pmap_worker_t *next;        /* the next idle worker */
+    struct _pmap_worker_t *all;         /* the next worker of the pool */
+    ErlNifTid tid;
+    ErlNifMutex *lock;
+    ErlNifCond *cond;
+    lua_State *L;
+    int quit;
+    pmap_job_t *job;
+    unsigned id;
+    ErlNifEnv *env;             /* the results and the error of the job */
+    unsigned done;
+    int failed;
+    ERL_NIF_TERM error;
+} pmap_worker_t;
+
+typedef struct _pmap_call_t {
+    pmap_worker_t *worker;
+    ErlNifEnv *input_env;
+    unsigned idx;
+} pmap_call_t;
+
+static ErlNifMutex *POOL_LOCK;
+static ErlNifCond *POOL_COND;
+static pmap_worker_t *POOL_IDLE;
+static pmap_worker_t *POOL_ALL;
+static unsigned POOL_SIZE;
+
+
+/*
+ * Take the next chunk index from the own queue or steal a half of the remainder
+ * of the first non-empty queue of another worker. Returns 0 if there is nothing left to do
+ */
+static int
+pmap_take(pmap_job_t *job, unsigned self, unsigned *idx) {
+    pmap_queue_t *own = &job->queues[self], *victim;
+    unsigned i, start, take;
+
+    enif_mutex_lock(own->lock);
+    if(own->lo < own->hi) {
+        *idx = own->lo++;
+        enif_mutex_unlock(own->lock);
+        return 1;
+    }
+    enif_mutex_unlock(own->lock);
+
+    for(i = 1; i < job->nworkers; i++) {
+        victim = &job->queues[(self + i) % job->nworkers];
+        enif_mutex_lock(victim->lock);
+        if(victim->lo < victim->hi) {
+            take = (victim->hi - victim->lo + 1) / 2;
+            start = victim->hi - take;
+            victim->hi = start;
+            enif_mutex_unlock(victim->lock);
+
+            enif_mutex_lock(own->lock);
+            own->lo = start + 1;
+            own->hi = start + take;
+            enif_mutex_unlock(own->lock);
+            *idx = start;
+            return 1;
+        }
+        enif_mutex_unlock(victim->lock);
+    }
+    return 0;
+}
+
+/*
+ * Pop the error object from the stack and convert it to the Erlang term
+ */
+static ERL_NIF_TERM
+pmap_reason(ErlNifEnv *env, lua_State *L) {
+    ERL_NIF_TERM reason;
+    if(!protected_get_term(env, L, -1, &reason)) {
+        reason = enif_make_atom(env, "null");
+    }
+    lua_pop(L, 1);
+    return reason;
+}
+
+static ERL_NIF_TERM
+pmap_error(ErlNifEnv *env, ERL_NIF_TERM reason) {
+    return enif_make_tuple2(env, enif_make_atom(env, "error"), reason);
+}
+
+/*
+ * Load the chunk of the job. It gets its own globals table backed by the real ones,
+ * so the globals it sets do not outlive the call in the reused state
+ */
+static int
+pmap_load(lua_State *L) {
+    pmap_job_t *job = (pmap_job_t*)lua_touserdata(L, 1);
+    if(luaL_loadbuffer(L, job->chunk, job->size, "pmap") != LUA_OK) return lua_error(L);
+    lua_createtable(L, 0, 0);
+    lua_createtable(L, 0, 1);
+#if LUA_VERSION_NUM == 501
+    lua_pushvalue(L, LUA_GLOBALSINDEX);
+    lua_setfield(L, -2, "__index");
+    lua_setmetatable(L, -2);
+    lua_setfenv(L, -2);
+#else
+    lua_pushglobaltable(L);
+    lua_setfield(L, -2, "__index");
+    lua_setmetatable(L, -2);
+    if(!lua_setupvalue(L, -2, 1)) lua_pop(L, 1);
+#endif
+    return 1;
+}
+
+/*
+ * Call the chunk (the second argument) with one input and store its converted result
+ */
+static int
+pmap_call(lua_State *L) {
+    pmap_call_t *c = (pmap_call_t*)lua_touserdata(L, 1);
+    pmap_worker_t *w = c->worker;
+    ERL_NIF_TERM *result = &w->job->results[c->idx];
+
+    lua_settop(L, 2);
+    if(!push_term(c->input_env, L, w->job->inputs[c->idx], 0)) {
+        *result = pmap_error(w->env, enif_make_atom(w->env, "badarg"));
+    } else if(lua_pcall(L, 1, 1, 0) != LUA_OK) {
+        *result = pmap_error(w->env, pmap_reason(w->env, L));
+    } else if(!get_term(w->env, L, -1, 0, result)) {
+        *result = pmap_error(w->env, enif_make_atom(w->env, "badarg"));
+    }
+    return 0;
+}
+
+/*
+ * Run the job in the state of the worker. Everything touching the state runs under lua_pcall,
+ * an error escaping it would unwind the stack of the worker thread
+ */
+static void
+pmap_run(pmap_worker_t *w) {
+    pmap_job_t *job = w->job;
+    lua_State *L = w->L;
+    pmap_chunk_t *chunk;
+    pmap_call_t call;
+    unsigned c;
+
+    lua_settop(L, 0);
+    lua_pushcfunction(L, pmap_load);
+    lua_pushlightuserdata(L, job);
+    if(lua_pcall(L, 1, 1, 0) != LUA_OK) {
+        w->error = pmap_reason(w->env, L);
+        w->failed = 1;
+        return;
+    }
+
+    call.worker = w;
+    while(pmap_take(job, w->id, &c)) {
+        chunk = &job->chunks[c];
+        call.input_env = chunk->env;
+        for(call.idx = chunk->lo; call.idx < chunk->hi; call.idx++) {
+            lua_pushcfunction(L, pmap_call);
+            lua_pushlightuserdata(L, &call);
+            lua_pushvalue(L, 1);
+            if(lua_pcall(L, 2, 0, 0) != LUA_OK) {
+                job->results[call.idx] = pmap_error(w->env, pmap_reason(w->env, L));
+            }
+            lua_settop(L, 1);
+            w->done++;
+        }
+    }
+    lua_settop(L, 0);
+}
+
+static void*
+pmap_thread(void *arg) {
+    pmap_worker_t *w = (pmap_worker_t*)arg;
+    pmap_job_t *job;
+
+    enif_mutex_lock(w->lock);
+    for(;;) {
+        while(!w->job && !w->quit) enif_cond_wait(w->cond, w->lock);
+        if(w->quit) break;
+        enif_mutex_unlock(w->lock);
+        pmap_run(w);
+        enif_mutex_lock(w->lock);
+        job = w->job;
+        w->job = NULL;
+        enif_mutex_lock(job->lock);
+        if(--job->running == 0) enif_cond_signal(job->cond);
+        enif_mutex_unlock(job->lock);
+    }
+    enif_mutex_unlock(w->lock);
+    return NULL;
+}
+
+static void
+worker_free(pmap_worker_t *w) {
+    if(w->L) lua_close(w->L);
+    if(w->env) enif_free_env(w->env);
+    if(w->cond) enif_cond_destroy(w->cond);
+    if(w->lock) enif_mutex_destroy(w->lock);
+    enif_free(w);
+}
+
+/*
+ * Start a new worker and add it to the pool. Must be called with POOL_LOCK held
+ */
+static pmap_worker_t*
+worker_create(void) {
+    pmap_worker_t *w = enif_alloc(sizeof(pmap_worker_t));
+    if(!w) return NULL;
+    memset(w, 0, sizeof(pmap_worker_t));
+    w->lock = enif_mutex_create("erlylua_pmap_worker");
+    w->cond = enif_cond_create("erlylua_pmap_worker");
+    w->env = enif_alloc_env();
+    w->L = open_state();
+    if(!w->lock || !w->cond || !w->env || !w->L
+        || enif_thread_create("erlylua_pmap", &w->tid, pmap_thread, w, NULL)) {
+        worker_free(w);
+        return NULL;
+    }
+    w->all = POOL_ALL;
+    POOL_ALL = w;
+    POOL_SIZE++;
+    return w;
+}
+
+/*
+ * Take up to n idle workers, starting new ones while the pool is below MAX_WORKERS.
+ * Waits if all the workers are busy with other calls. Returns the number of workers taken
+ */
+static unsigned
+pool_acquire(pmap_worker_t **workers, unsigned n) {
+    pmap_worker_t *w;
+    unsigned got = 0;
+
+    enif_mutex_lock(POOL_LOCK);
+    for(;;) {
+        while(got < n && POOL_IDLE) {
+            workers[got++] = POOL_IDLE;
+            POOL_IDLE = POOL_IDLE->next;
+        }
+        while(got < n && POOL_SIZE < MAX_WORKERS && (w = worker_create())) {
+            workers[got++] = w;
+        }
+        if(got || !POOL_SIZE) break;
+        enif_cond_wait(POOL_COND, POOL_LOCK);
+    }
+    enif_mutex_unlock(POOL_LOCK);
+    return got;
+}
+
+static void
+pool_release(pmap_worker_t **workers, unsigned n) {
+    unsigned i;
+    enif_mutex_lock(POOL_LOCK);
+    for(i = 0; i < n; i++) {
+        workers[i]->next = POOL_IDLE;
+        POOL_IDLE = workers[i];
+    }
+    enif_cond_broadcast(POOL_COND);
+    enif_mutex_unlock(POOL_LOCK);
+}
+
+int
+pmap_init(void) {
+    POOL_IDLE = POOL_ALL = NULL;
+    POOL_SIZE = 0;
+    POOL_LOCK = enif_mutex_create("erlylua_pmap_pool");
+    POOL_COND = enif_cond_create("erlylua_pmap_pool");
+    return POOL_LOCK && POOL_COND;
+}
+
+/*
+ * Stop the workers and close their states. No pmap call may be running
+ */
+void
+pmap_free(void) {
+    pmap_worker_t *w, *next;
+    for(w = POOL_ALL; w; w = next) {
+        next = w->all;
+        enif_mutex_lock(w->lock);
+        w->quit = 1;
+        enif_cond_signal(w->cond);
+        enif_mutex_unlock(w->lock);
+        enif_thread_join(w->tid, NULL);
+        worker_free(w);
+    }
+    POOL_IDLE = POOL_ALL = NULL;
+    POOL_SIZE = 0;
+    if(POOL_COND) enif_cond_destroy(POOL_COND);
+    if(POOL_LOCK) enif_mutex_destroy(POOL_LOCK);
+    POOL_COND = NULL;
+    POOL_LOCK = NULL;
+}
+
+/*
+ * Free what job_init allocated, nworkers is the number of the queues
+ */
+static void
+job_free(pmap_job_t *job, unsigned nworkers) {
+    unsigned i;
+    if(job->queues) {
+        for(i = 0; i < nworkers; i++) {
+            if(job->queues[i].lock) enif_mutex_destroy(job->queues[i].lock);
+        }
+        enif_free(job->queues);
+    }
+    if(job->chunks) {
+        for(i = 0; i < job->nchunks; i++) {
+            if(job->chunks[i].env) enif_free_env(job->chunks[i].env);
+        }
+        enif_free(job->chunks);
+    }
+    if(job->inputs) enif_free(job->inputs);
+    if(job->results) enif_free(job->results);
+    if(job->cond) enif_cond_destroy(job->cond);
+    if(job->lock) enif_mutex_destroy(job->lock);
+}
+
+/*
+ * Allocate the job for up to nworkers workers and copy the inputs once,
+ * chunk by chunk, into the chunk environments. Returns 0 if out of memory
+ */
+static int
+job_init(pmap_job_t *job, ErlNifEnv *env, ERL_NIF_TERM list, unsigned count, unsigned nworkers) {
+    ERL_NIF_TERM head;
+    unsigned i, j, per_chunk;
+
+    memset(job, 0, sizeof(pmap_job_t));
+    job->count = count;
+    job->nchunks = count < nworkers * CHUNKS_PER_WORKER ? count : nworkers * CHUNKS_PER_WORKER;
+    job->lock = enif_mutex_create("erlylua_pmap");
+    job->cond = enif_cond_create("erlylua_pmap");
+    job->inputs = enif_alloc(sizeof(ERL_NIF_TERM) * count);
+    job->results = enif_alloc(sizeof(ERL_NIF_TERM) * count);
+    job->chunks = enif_alloc(sizeof(pmap_chunk_t) * job->nchunks);
+    job->queues = enif_alloc(sizeof(pmap_queue_t) * nworkers);
+    if(!job->lock || !job->cond || !job->inputs || !job->results || !job->chunks || !job->queues) {
+        if(job->chunks) enif_free(job->chunks);
+        if(job->queues) enif_free(job->queues);
+        job->chunks = NULL;
+        job->queues = NULL;
+        return 0;
+    }
+    memset(job->chunks, 0, sizeof(pmap_chunk_t) * job->nchunks);
+    memset(job->queues, 0, sizeof(pmap_queue_t) * nworkers);
+    for(i = 0; i < nworkers; i++) {
+        if(!(job->queues[i].lock = enif_mutex_create("erlylua_pmap"))) return 0;
+    }
+
+    /* Worker threads must not touch terms of the calling process */
+    per_chunk = count / job->nchunks;
+    for(i = 0, j = 0; i < job->nchunks; i++) {
+        pmap_chunk_t *chunk = &job->chunks[i];
+        if(!(chunk->env = enif_alloc_env())) return 0;
+        chunk->lo = j;
+        chunk->hi = i == job->nchunks - 1 ? count : j + per_chunk;
+        for(; j < chunk->hi && enif_get_list_cell(env, list, &head, &list); j++) {
+            job->inputs[j] = enif_make_copy(chunk->env, head);
+        }
+    }
+    return 1;
+}
+
+/*
+ * Load the given chunk into the states of the worker pool, call it once per input term
+ * and return the results in the order of inputs.
+ * argv[0] - the chunk (source or bytecode), argv[1] - the list of inputs, argv[2] - the number of workers
+ */
+ERL_NIF_TERM
+nif_pmap(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
+    ErlNifBinary chunk;
+    ERL_NIF_TERM ret;
+    pmap_job_t job;
+    pmap_worker_t **workers, *w;
+    unsigned i, count, nworkers, requested, per_worker, done = 0;
+    int failed = -1;
+
+    if(!enif_inspect_binary(env, argv[0], &chunk)
+        || !enif_get_list_length(env, argv[1], &count)
+        || !enif_get_uint(env, argv[2], &nworkers)) {
+        return enif_make_badarg(env);
+    }
+    if(count == 0) {
+        return enif_make_tuple2(env, enif_make_atom(env, "ok"), enif_make_list(env, 0));
+    }
+    if(nworkers > MAX_WORKERS) nworkers = MAX_WORKERS;
+    if(nworkers > count) nworkers = count;
+    if(nworkers == 0) nworkers = 1;
+    requested = nworkers;
+
+    if(!(workers = enif_alloc(sizeof(pmap_worker_t*) * requested))) {
+        return pmap_error(env, enif_make_string(env, "Not enough memory", ERL_NIF_LATIN1));
+    }
+    if(!job_init(&job, env, argv[1], count, requested)) {
+        job_free(&job, requested);
+        enif_free(workers);
+        return pmap_error(env, enif_make_string(env, "Not enough memory", ERL_NIF_LATIN1));
+    }
+    if(!(nworkers = pool_acquire(workers, requested))) {
+        job_free(&job, requested);
+        enif_free(workers);
+        return pmap_error(env, enif_make_string(env, "Could not start pmap workers", ERL_NIF_LATIN1));
+    }
+
+    job.chunk = (const char*)chunk.data;
+    job.size = chunk.size;
+    job.nworkers = nworkers;
+    job.running = nworkers;
+
+    per_worker = job.nchunks / nworkers;
+    for(i = 0; i < nworkers; i++) {
+        job.queues[i].lo = i * per_worker;
+        job.queues[i].hi = i == nworkers - 1 ? job.nchunks : (i + 1) * per_worker;
+    }
+    for(i = 0; i < nworkers; i++) {
+        w = workers[i];
+        w->id = i;
+        w->done = 0;
+        w->failed = 0;
+        enif_mutex_lock(w->lock);
+        w->job = &job;
+        enif_cond_signal(w->cond);
+        enif_mutex_unlock(w->lock);
+    }
+
+    enif_mutex_lock(job.lock);
+    while(job.running) enif_cond_wait(job.cond, job.lock);
+    enif_mutex_unlock(job.lock);
+
+    for(i = 0; i < nworkers; i++) {
+        if(workers[i]->failed && failed < 0) failed = i;
+        done += workers[i]->done;
+    }
+    if(failed >= 0) {
+        ret = pmap_error(env, enif_make_copy(env, workers[failed]->error));
+    } else if(done < count) {
+        ret = pmap_error(env, enif_make_string(env, "Could not start pmap workers", ERL_NIF_LATIN1));
+    } else {
+        ret = enif_make_list(env, 0);
+        for(i = count; i > 0; i--) {
+            ret = enif_make_list_cell(env, enif_make_copy(env, job.results[i-1]), ret);
+        }
+        ret = enif_make_tuple2(env, enif_make_atom(env, "ok"), ret);
+    }
+
+    for(i = 0; i < nworkers; i++) {
+        enif_clear_env(workers[i]->env);
+    }
+    pool_release(workers, nworkers);
+    job_free(&job, requested);
+    enif_free(workers);
+    return ret;
+}
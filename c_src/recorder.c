@@ -0,0 +1,276 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <erl_nif.h>
+
+#include "erlylua.h"
+
+/* enif_term_to_binary appeared in NIF 2.11 (OTP 19) */
+#if ERL_NIF_MAJOR_VERSION > 2 || (ERL_NIF_MAJOR_VERSION == 2 && ERL_NIF_MINOR_VERSION >= 11)
+#define HAVE_RECORDER 1
+#endif
+
+#define RECORD_BUF_SIZE (64 * 1024)
+#define CHUNK_MIN_SIZE 64
+
+/*
+ * File format: "ERLYLUA" 1, then records
+ *   'C' Size:32 Hash:64 Data         - a binary argument stored once
+ *   'R' Size:32 ETF                  - {Op, Args, Start, Duration}, times in nanoseconds,
+ *                                      stored binaries are replaced with {'$chunk', Hash}
+ */
+static const char RECORD_HEADER[8] = { 'E', 'R', 'L', 'Y', 'L', 'U', 'A', 1 };
+
+
+typedef struct _record_buf_t {
+    struct _record_buf_t *next;
+    size_t size;
+    size_t capacity;
+    unsigned char data[];
+} record_buf_t;
+
+struct _recorder_t {
+    ErlNifMutex *lock;
+    ErlNifCond *cond;
+    ErlNifTid tid;
+    FILE *file;
+    record_buf_t *current;      /* being filled by the calling threads */
+    record_buf_t *head;         /* full buffers waiting for the writer thread */
+    record_buf_t *tail;
+    int stop;
+    int failed;                 /* a write failed, the rest of the log is dropped */
+    ErlNifTime started;
+    ErlNifUInt64 *chunks;       /* open addressing set of the stored binary hashes */
+    size_t nchunks;
+    size_t chunks_size;
+};
+
+
+volatile int RECORDERS = 0;
+
+
+#ifdef HAVE_RECORDER
+
+static ErlNifUInt64
+chunk_hash(const unsigned char *data, size_t size) {
+    ErlNifUInt64 hash = 14695981039346656037ULL;
+    while(size--) {
+        hash = (hash ^ *data++) * 1099511628211ULL;
+    }
+    return hash ? hash : 1;
+}
+
+/*
+ * Add the hash to the set of stored binaries. Returns 0 if it is already there
+ */
+static int
+chunk_add(recorder_t *r, ErlNifUInt64 hash) {
+    size_t i;
+    if((r->nchunks + 1) * 2 > r->chunks_size) {
+        ErlNifUInt64 *old = r->chunks;
+        size_t old_size = r->chunks_size;
+        r->chunks_size = old_size ? old_size * 2 : 64;
+        r->chunks = enif_alloc(sizeof(ErlNifUInt64) * r->chunks_size);
+        memset(r->chunks, 0, sizeof(ErlNifUInt64) * r->chunks_size);
+        r->nchunks = 0;
+        for(i = 0; i < old_size; i++) {
+            if(old[i]) chunk_add(r, old[i]);
+        }
+        if(old) enif_free(old);
+    }
+    for(i = hash % r->chunks_size; r->chunks[i]; i = (i + 1) % r->chunks_size) {
+        if(r->chunks[i] == hash) return 0;
+    }
+    r->chunks[i] = hash;
+    r->nchunks++;
+    return 1;
+}
+
+static void
+recorder_enqueue(recorder_t *r) {
+    if(!r->current) return;
+    if(r->tail) {
+        r->tail->next = r->current;
+    } else {
+        r->head = r->current;
+    }
+    r->tail = r->current;
+    r->current = NULL;
+    enif_cond_signal(r->cond);
+}
+
+/*
+ * Reserve the space for a record of the given type and size. Must be called with the lock held
+ */
+static unsigned char*
+recorder_reserve(recorder_t *r, char type, size_t size) {
+    record_buf_t *b = r->current;
+    unsigned char *p;
+    size_t total = size + 5;
+
+    if(b && b->size + total > b->capacity) {
+        recorder_enqueue(r);
+        b = NULL;
+    }
+    if(!b) {
+        size_t capacity = total > RECORD_BUF_SIZE ? total : RECORD_BUF_SIZE;
+        b = enif_alloc(sizeof(record_buf_t) + capacity);
+        b->next = NULL;
+        b->size = 0;
+        b->capacity = capacity;
+        r->current = b;
+    }
+    p = b->data + b->size;
+    b->size += total;
+    p[0] = type;
+    p[1] = (size >> 24) & 0xff;
+    p[2] = (size >> 16) & 0xff;
+    p[3] = (size >> 8) & 0xff;
+    p[4] = size & 0xff;
+    return p + 5;
+}
+
+static void*
+recorder_writer(void *arg) {
+    recorder_t *r = (recorder_t*)arg;
+    record_buf_t *b;
+    int written;
+
+    enif_mutex_lock(r->lock);
+    for(;;) {
+        while(!r->head && !r->stop) {
+            enif_cond_wait(r->cond, r->lock);
+        }
+        if(!(b = r->head)) break;
+        r->head = b->next;
+        if(!r->head) r->tail = NULL;
+        enif_mutex_unlock(r->lock);
+
+        /* Only this thread sets failed, it is read here without the lock */
+        written = r->failed || fwrite(b->data, 1, b->size, r->file) == b->size;
+        enif_free(b);
+
+        enif_mutex_lock(r->lock);
+        if(!written) r->failed = 1;
+    }
+    enif_mutex_unlock(r->lock);
+    return NULL;
+}
+
+recorder_t*
+recorder_start(const char *filename) {
+    recorder_t *r;
+    FILE *file = fopen(filename, "wb");
+    if(!file) return NULL;
+    if(fwrite(RECORD_HEADER, 1, sizeof(RECORD_HEADER), file) != sizeof(RECORD_HEADER)) {
+        fclose(file);
+        return NULL;
+    }
+
+    r = enif_alloc(sizeof(recorder_t));
+    memset(r, 0, sizeof(recorder_t));
+    r->file = file;
+    r->lock = enif_mutex_create("erlylua_recorder");
+    r->cond = enif_cond_create("erlylua_recorder");
+    r->started = enif_monotonic_time(ERL_NIF_NSEC);
+    if(enif_thread_create("erlylua_recorder", &r->tid, recorder_writer, r, NULL)) {
+        enif_cond_destroy(r->cond);
+        enif_mutex_destroy(r->lock);
+        enif_free(r);
+        fclose(file);
+        return NULL;
+    }
+    __sync_add_and_fetch(&RECORDERS, 1);
+    return r;
+}
+
+/*
+ * Flush the log and free the recorder. Returns 0 if any part of the log could not be written
+ */
+int
+recorder_stop(recorder_t *r) {
+    int ok;
+    enif_mutex_lock(r->lock);
+    recorder_enqueue(r);
+    r->stop = 1;
+    enif_cond_signal(r->cond);
+    enif_mutex_unlock(r->lock);
+
+    enif_thread_join(r->tid, NULL);
+    __sync_sub_and_fetch(&RECORDERS, 1);
+    ok = fclose(r->file) == 0 && !r->failed;
+    enif_cond_destroy(r->cond);
+    enif_mutex_destroy(r->lock);
+    if(r->chunks) enif_free(r->chunks);
+    enif_free(r);
+    return ok;
+}
+
+void
+recorder_log(recorder_t *r, ErlNifEnv *env, const char *op, int args, const ERL_NIF_TERM argv[],
+        ErlNifTime start, ErlNifTime duration) {
+    ERL_NIF_TERM list = enif_make_list(env, 0), arg;
+    ErlNifBinary bin, etf;
+    ErlNifUInt64 hashes[4];
+    unsigned char *p;
+    int i, j, nhashes = 0;
+
+    /* argv[0] is the state itself */
+    for(i = args - 1; i >= 1; i--) {
+        arg = argv[i];
+        if(nhashes < 4 && enif_inspect_binary(env, arg, &bin) && bin.size >= CHUNK_MIN_SIZE) {
+            hashes[nhashes] = chunk_hash(bin.data, bin.size);
+            arg = enif_make_tuple2(env, enif_make_atom(env, "$chunk"), enif_make_uint64(env, hashes[nhashes++]));
+        }
+        list = enif_make_list_cell(env, arg, list);
+    }
+    if(!enif_term_to_binary(env, enif_make_tuple4(env, enif_make_atom(env, op), list,
+            enif_make_int64(env, start - r->started), enif_make_int64(env, duration)), &etf)) {
+        return;
+    }
+
+    enif_mutex_lock(r->lock);
+    if(r->failed) {
+        /* Do not keep buffering a log which can not be written */
+        enif_mutex_unlock(r->lock);
+        enif_release_binary(&etf);
+        return;
+    }
+    for(i = args - 1, j = 0; j < nhashes && i >= 1; i--) {
+        if(enif_inspect_binary(env, argv[i], &bin) && bin.size >= CHUNK_MIN_SIZE) {
+            ErlNifUInt64 hash = hashes[j++];
+            if(chunk_add(r, hash)) {
+                int shift;
+                p = recorder_reserve(r, 'C', bin.size + 8);
+                for(shift = 56; shift >= 0; shift -= 8) {
+                    *p++ = (hash >> shift) & 0xff;
+                }
+                memcpy(p, bin.data, bin.size);
+            }
+        }
+    }
+    p = recorder_reserve(r, 'R', etf.size);
+    memcpy(p, etf.data, etf.size);
+    enif_mutex_unlock(r->lock);
+
+    enif_release_binary(&etf);
+}
+
+#else
+
+recorder_t*
+recorder_start(const char *filename) {
+    return NULL;
+}
+
+int
+recorder_stop(recorder_t *r) {
+    return 1;
+}
+
+void
+recorder_log(recorder_t *r, ErlNifEnv *env, const char *op, int args, const ERL_NIF_TERM argv[],
+        ErlNifTime start, ErlNifTime duration) {
+}
+
+#endif
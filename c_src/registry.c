@@ -0,0 +1,218 @@
+#include <stdlib.h>
+#include <string.h>
+#include <erl_nif.h>
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "erlylua.h"
+
+#define REGISTRY_SIZE 256
+
+
+/* A compiled module shared by all Lua states of the node */
+typedef struct _module_t {
+    struct _module_t *next;
+    char *name;
+    size_t name_len;
+    char *chunkname;
+    char *code;
+    size_t size;
+    unsigned version;
+} module_t;
+
+
+static ErlNifRWLock *REGISTRY_LOCK;
+static module_t *REGISTRY[REGISTRY_SIZE];
+
+
+static unsigned
+registry_hash(const char *name, size_t len) {
+    unsigned hash = 2166136261u;
+    while(len--) {
+        hash = (hash ^ (unsigned char)*name++) * 16777619u;
+    }
+    return hash % REGISTRY_SIZE;
+}
+
+static module_t**
+registry_find(const char *name, size_t len) {
+    module_t **m = &REGISTRY[registry_hash(name, len)];
+    for(; *m; m = &(*m)->next) {
+        if((*m)->name_len == len && !memcmp((*m)->name, name, len)) break;
+    }
+    return m;
+}
+
+static void
+module_free(module_t *m) {
+    enif_free(m->name);
+    enif_free(m->chunkname);
+    free(m->code);
+    enif_free(m);
+}
+
+int
+registry_init(void) {
+    memset(REGISTRY, 0, sizeof(REGISTRY));
+    REGISTRY_LOCK = enif_rwlock_create("erlylua_registry");
+    return REGISTRY_LOCK != NULL;
+}
+
+void
+registry_free(void) {
+    module_t *m, *next;
+    int i;
+    for(i = 0; i < REGISTRY_SIZE; i++) {
+        for(m = REGISTRY[i]; m; m = next) {
+            next = m->next;
+            module_free(m);
+        }
+        REGISTRY[i] = NULL;
+    }
+    if(REGISTRY_LOCK) enif_rwlock_destroy(REGISTRY_LOCK);
+    REGISTRY_LOCK = NULL;
+}
+
+/*
+ * A package.searchers entry which loads modules from the registry
+ */
+static int
+registry_searcher(lua_State *L) {
+    size_t len;
+    const char *name = luaL_checklstring(L, 1, &len);
+    module_t *m;
+    int ret;
+
+    enif_rwlock_rlock(REGISTRY_LOCK);
+    m = *registry_find(name, len);
+    ret = m ? luaL_loadbuffer(L, m->code, m->size, m->chunkname) : LUA_OK;
+    enif_rwlock_runlock(REGISTRY_LOCK);
+
+    if(!m) {
+        lua_pushfstring(L, "\n\tno module '%s' in the erlylua registry", name);
+        return 1;
+    } else if(ret != LUA_OK) {
+        return luaL_error(L, "error loading module '%s' from the erlylua registry:\n\t%s",
+            name, lua_tostring(L, -1));
+    }
+    lua_pushstring(L, ":registry:");
+    return 2;
+}
+
+/*
+ * Insert the registry searcher into package.searchers right after the preload searcher
+ */
+void
+registry_open(lua_State *L) {
+    int i;
+    if(lua_getglobal(L, "package") == LUA_TTABLE
+        && lua_getfield(L, -1, LUA_SEARCHERS) == LUA_TTABLE) {
+        for(i = lua_rawlen(L, -1); i >= 2; i--) {
+            lua_rawgeti(L, -1, i);
+            lua_rawseti(L, -2, i+1);
+        }
+        lua_pushcfunction(L, registry_searcher);
+        lua_rawseti(L, -2, 2);
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+}
+
+/*
+ * Compile the chunk (a source or a bytecode) once and store its bytecode in the registry
+ * replacing the previous version of the module.
+ * argv[0] - the module name, argv[1] - the chunk
+ */
+ERL_NIF_TERM
+nif_register_module(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
+    ErlNifBinary name, chunk;
+    writer_t wrt = { NULL, 0, 0 };
+    module_t *m, **found;
+    lua_State *L;
+    ERL_NIF_TERM ret;
+    unsigned version;
+    int status;
+
+    if(!enif_inspect_binary(env, argv[0], &name) || !enif_inspect_binary(env, argv[1], &chunk) || !name.size) {
+        return enif_make_badarg(env);
+    }
+    if(!(L = luaL_newstate())) {
+        return enif_make_tuple2(env, enif_make_atom(env, "error"),
+            enif_make_string(env, "Could not initialize the Lua VM", ERL_NIF_LATIN1));
+    }
+
+    m = enif_alloc(sizeof(module_t));
+    m->next = NULL;
+    m->name_len = name.size;
+    m->name = enif_alloc(name.size + 1);
+    memcpy(m->name, name.data, name.size);
+    m->name[name.size] = '\0';
+    m->chunkname = enif_alloc(name.size + 2);
+    m->chunkname[0] = '=';
+    memcpy(m->chunkname + 1, m->name, name.size + 1);
+
+    status = luaL_loadbuffer(L, (const char*)chunk.data, chunk.size, m->chunkname);
+    if(status == LUA_OK) status = lua_dump(L, lua_writer, &wrt, 0);
+    if(status != LUA_OK || !wrt.bin) {
+        if(status != LUA_OK && lua_isstring(L, -1)) {
+            ret = enif_make_string(env, lua_tostring(L, -1), ERL_NIF_LATIN1);
+        } else {
+            ret = enif_make_atom(env, "null");
+        }
+        lua_close(L);
+        if(wrt.bin) free(wrt.bin);
+        m->code = NULL;
+        module_free(m);
+        return enif_make_tuple2(env, enif_make_atom(env, "error"), ret);
+    }
+    lua_close(L);
+    m->code = wrt.bin;
+    m->size = wrt.cur;
+
+    enif_rwlock_rwlock(REGISTRY_LOCK);
+    found = registry_find(m->name, m->name_len);
+    if(*found) {
+        m->version = (*found)->version + 1;
+        m->next = (*found)->next;
+        module_free(*found);
+    } else {
+        m->version = 1;
+    }
+    *found = m;
+    version = m->version;
+    enif_rwlock_rwunlock(REGISTRY_LOCK);
+
+    return enif_make_tuple2(env, enif_make_atom(env, "ok"), enif_make_uint(env, version));
+}
+
+ERL_NIF_TERM
+nif_unregister_module(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
+    ErlNifBinary name;
+    module_t *m, **found;
+    if(!enif_inspect_binary(env, argv[0], &name)) return enif_make_badarg(env);
+
+    enif_rwlock_rwlock(REGISTRY_LOCK);
+    found = registry_find((const char*)name.data, name.size);
+    if((m = *found)) *found = m->next;
+    enif_rwlock_rwunlock(REGISTRY_LOCK);
+
+    if(m) module_free(m);
+    return enif_make_atom(env, "ok");
+}
+
+ERL_NIF_TERM
+nif_registered_modules(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
+    ERL_NIF_TERM list = enif_make_list(env, 0), name;
+    module_t *m;
+    int i;
+
+    enif_rwlock_rlock(REGISTRY_LOCK);
+    for(i = 0; i < REGISTRY_SIZE; i++) {
+        for(m = REGISTRY[i]; m; m = m->next) {
+            memcpy(enif_make_new_binary(env, m->name_len, &name), m->name, m->name_len);
+            list = enif_make_list_cell(env, enif_make_tuple2(env, name, enif_make_uint(env, m->version)), list);
+        }
+    }
+    enif_rwlock_runlock(REGISTRY_LOCK);
+    return list;
+}
@@ -0,0 +1,550 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <erl_nif.h>
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "erlylua.h"
+
+#define SHARED_META "erlylua.shared"
+#define ALIGN(size) (((size) + 7) & ~(size_t)7)
+
+
+enum { S_NIL, S_BOOLEAN, S_INTEGER, S_NUMBER, S_STRING, S_TABLE };
+
+struct _shared_table_t;
+
+/* A value of the shared data. Strings and tables point into the arena */
+typedef struct _shared_value_t {
+    unsigned char type;
+    uint32_t len;
+    union {
+        int b;
+        ErlNifSInt64 i;
+        double d;
+        const char *s;
+        const struct _shared_table_t *t;
+    } u;
+} shared_value_t;
+
+typedef struct _shared_entry_t {
+    shared_value_t key;
+    shared_value_t value;
+} shared_entry_t;
+
+/*
+ * Lists and tuples are stored in the array part (keys 1..narr),
+ * maps are stored in the entries part sorted by key
+ */
+typedef struct _shared_table_t {
+    size_t narr;
+    size_t nentries;
+    size_t len;
+    const shared_value_t *array;
+    const shared_entry_t *entries;
+} shared_table_t;
+
+/* The resource owning the arena with the whole data */
+typedef struct _shared_t {
+    char *arena;
+    size_t size;
+    const shared_table_t *root;
+} shared_t;
+
+/* The Lua userdata referencing a table of the shared data */
+typedef struct _shared_ref_t {
+    shared_t *shared;
+    const shared_table_t *table;
+    int owned;                  /* the userdata holds its own reference to the resource */
+} shared_ref_t;
+
+typedef struct _builder_t {
+    ErlNifEnv *env;
+    char *cur;
+} builder_t;
+
+
+static ErlNifResourceType *SHARED_RESOURCE;
+static const char CACHE_KEY = 'c';
+
+
+static void
+shared_dtor(ErlNifEnv *env, void *obj) {
+    shared_t *shared = (shared_t*)obj;
+    if(shared->arena) enif_free(shared->arena);
+}
+
+int
+shared_init(ErlNifEnv *env) {
+    SHARED_RESOURCE = enif_open_resource_type(env, NULL, "erlylua_shared", shared_dtor, ERL_NIF_RT_CREATE, NULL);
+    return SHARED_RESOURCE != NULL;
+}
+
+
+/*
+ * Count the arena size needed to store the term. Returns 0 if the term can not be stored
+ */
+static int
+shared_size(ErlNifEnv *env, ERL_NIF_TERM term, int depth, size_t *size) {
+    ErlNifSInt64 i;
+    double d;
+    unsigned len;
+    size_t count;
+    ErlNifBinary bin;
+
+    if(depth > MAX_TERM_DEPTH) return 0;
+
+    if(enif_get_int64(env, term, &i) || enif_get_double(env, term, &d)) {
+        return 1;
+    } else if(enif_get_atom_length(env, term, &len, ERL_NIF_LATIN1)) {
+        *size += ALIGN(len + 1);
+    } else if(enif_inspect_binary(env, term, &bin)) {
+        if(bin.size > UINT32_MAX) return 0;
+        *size += ALIGN(bin.size + 1);
+    } else if(enif_is_list(env, term)) {
+        ERL_NIF_TERM head, tail = term;
+        if(!enif_get_list_length(env, term, &len)) return 0;
+        *size += ALIGN(sizeof(shared_table_t)) + len * sizeof(shared_value_t);
+        while(enif_get_list_cell(env, tail, &head, &tail)) {
+            if(!shared_size(env, head, depth+1, size)) return 0;
+        }
+    } else if(enif_is_tuple(env, term)) {
+        const ERL_NIF_TERM *elems;
+        int arity, n;
+        enif_get_tuple(env, term, &arity, &elems);
+        *size += ALIGN(sizeof(shared_table_t)) + arity * sizeof(shared_value_t);
+        for(n = 0; n < arity; n++) {
+            if(!shared_size(env, elems[n], depth+1, size)) return 0;
+        }
+    } else if(enif_get_map_size(env, term, &count)) {
+        ErlNifMapIterator iter;
+        ERL_NIF_TERM key, value;
+        int ok = 1;
+        *size += ALIGN(sizeof(shared_table_t)) + count * sizeof(shared_entry_t);
+        enif_map_iterator_create(env, term, &iter, ERL_NIF_MAP_ITERATOR_FIRST);
+        while(ok && enif_map_iterator_get_pair(env, &iter, &key, &value)) {
+            ok = shared_size(env, key, depth+1, size) && shared_size(env, value, depth+1, size);
+            enif_map_iterator_next(env, &iter);
+        }
+        enif_map_iterator_destroy(env, &iter);
+        return ok;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+static void*
+shared_reserve(builder_t *b, size_t size) {
+    void *p = b->cur;
+    b->cur += ALIGN(size);
+    return p;
+}
+
+static int
+key_class(const shared_value_t *v) {
+    switch(v->type) {
+        case S_INTEGER:
+        case S_NUMBER: return 0;
+        case S_STRING: return 1;
+        default: return 2;
+    }
+}
+
+/*
+ * Order the keys: numbers, then strings, then booleans
+ */
+static int
+key_compare(const shared_value_t *a, const shared_value_t *b) {
+    int ca = key_class(a), cb = key_class(b), c;
+    if(ca != cb) return ca < cb ? -1 : 1;
+    switch(ca) {
+        case 0:
+            if(a->type == S_INTEGER && b->type == S_INTEGER) {
+                return a->u.i < b->u.i ? -1 : a->u.i > b->u.i;
+            } else {
+                double x = a->type == S_INTEGER ? (double)a->u.i : a->u.d;
+                double y = b->type == S_INTEGER ? (double)b->u.i : b->u.d;
+                return x < y ? -1 : x > y;
+            }
+        case 1:
+            c = memcmp(a->u.s, b->u.s, a->len < b->len ? a->len : b->len);
+            return c ? c : (a->len < b->len ? -1 : a->len > b->len);
+        default:
+            return a->u.b - b->u.b;
+    }
+}
+
+static int
+entry_compare(const void *a, const void *b) {
+    return key_compare(&((const shared_entry_t*)a)->key, &((const shared_entry_t*)b)->key);
+}
+
+/*
+ * Floats with integral values are the same keys as integers in Lua. Returns 0 for nil and NaN
+ */
+static int
+normalize_key(shared_value_t *key) {
+    if(key->type == S_NUMBER) {
+        double d = key->u.d;
+        if(d != d) return 0;
+        if(d >= -9223372036854775808.0 && d < 9223372036854775808.0 && d == (double)(ErlNifSInt64)d) {
+            key->type = S_INTEGER;
+            key->u.i = (ErlNifSInt64)d;
+        }
+    }
+    return key->type != S_NIL;
+}
+
+static int
+shared_build(builder_t *b, ERL_NIF_TERM term, shared_value_t *v) {
+    ErlNifEnv *env = b->env;
+    ErlNifBinary bin;
+    unsigned len;
+    size_t count, n;
+
+    memset(v, 0, sizeof(shared_value_t));
+    if(enif_get_int64(env, term, &v->u.i)) {
+        v->type = S_INTEGER;
+    } else if(enif_get_double(env, term, &v->u.d)) {
+        v->type = S_NUMBER;
+    } else if(enif_get_atom_length(env, term, &len, ERL_NIF_LATIN1)) {
+        char *str = shared_reserve(b, len + 1);
+        enif_get_atom(env, term, str, len + 1, ERL_NIF_LATIN1);
+        if(!strcmp(str, "true") || !strcmp(str, "false")) {
+            v->type = S_BOOLEAN;
+            v->u.b = str[0] == 't';
+        } else if(!strcmp(str, "nil")) {
+            v->type = S_NIL;
+        } else {
+            v->type = S_STRING;
+            v->len = len;
+            v->u.s = str;
+        }
+    } else if(enif_inspect_binary(env, term, &bin)) {
+        char *str = shared_reserve(b, bin.size + 1);
+        memcpy(str, bin.data, bin.size);
+        str[bin.size] = '\0';
+        v->type = S_STRING;
+        v->len = bin.size;
+        v->u.s = str;
+    } else if(enif_is_list(env, term) || enif_is_tuple(env, term)) {
+        shared_table_t *t = shared_reserve(b, sizeof(shared_table_t));
+        shared_value_t *array;
+        ERL_NIF_TERM head, tail = term;
+        const ERL_NIF_TERM *elems = NULL;
+        int arity = 0, tuple = enif_get_tuple(env, term, &arity, &elems);
+
+        if(tuple) {
+            count = arity;
+        } else {
+            enif_get_list_length(env, term, &len);
+            count = len;
+        }
+        array = shared_reserve(b, count * sizeof(shared_value_t));
+        for(n = 0; n < count; n++) {
+            if(!tuple) enif_get_list_cell(env, tail, &head, &tail);
+            if(!shared_build(b, tuple ? elems[n] : head, &array[n])) return 0;
+        }
+        t->narr = t->len = count;
+        t->nentries = 0;
+        t->array = array;
+        t->entries = NULL;
+        v->type = S_TABLE;
+        v->u.t = t;
+    } else if(enif_get_map_size(env, term, &count)) {
+        shared_table_t *t = shared_reserve(b, sizeof(shared_table_t));
+        shared_entry_t *entries = shared_reserve(b, count * sizeof(shared_entry_t));
+        ErlNifMapIterator iter;
+        ERL_NIF_TERM key, value;
+        int ok = 1;
+
+        enif_map_iterator_create(env, term, &iter, ERL_NIF_MAP_ITERATOR_FIRST);
+        for(n = 0; ok && enif_map_iterator_get_pair(env, &iter, &key, &value); n++) {
+            ok = shared_build(b, key, &entries[n].key) && normalize_key(&entries[n].key)
+                && shared_build(b, value, &entries[n].value);
+            enif_map_iterator_next(env, &iter);
+        }
+        enif_map_iterator_destroy(env, &iter);
+        if(!ok) return 0;
+
+        qsort(entries, count, sizeof(shared_entry_t), entry_compare);
+        t->len = 0;
+        for(n = 0; n < count; n++) {
+            /* Keys like 1 and 1.0 or <<"a">> and 'a' collide */
+            if(n > 0 && !key_compare(&entries[n-1].key, &entries[n].key)) return 0;
+            if(entries[n].key.type == S_INTEGER && entries[n].key.u.i == (ErlNifSInt64)t->len + 1) t->len++;
+        }
+        t->narr = 0;
+        t->nentries = count;
+        t->array = NULL;
+        t->entries = entries;
+        v->type = S_TABLE;
+        v->u.t = t;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+
+/*
+ * Find the position of the key: array slots go first, then the sorted entries. Returns -1 if not found
+ */
+static long
+table_pos(const shared_table_t *t, const shared_value_t *key) {
+    size_t lo = 0, hi = t->nentries, mid;
+    int c;
+    if(key->type == S_INTEGER && key->u.i >= 1 && (ErlNifUInt64)key->u.i <= t->narr) {
+        return (long)key->u.i - 1;
+    }
+    while(lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        c = key_compare(key, &t->entries[mid].key);
+        if(!c) return (long)(t->narr + mid);
+        if(c < 0) hi = mid;
+        else lo = mid + 1;
+    }
+    return -1;
+}
+
+/*
+ * Convert the Lua value to the key. Returns 0 if no key of the shared data can be equal to it
+ */
+static int
+lua_key(lua_State *L, int idx, shared_value_t *key) {
+    memset(key, 0, sizeof(shared_value_t));
+    switch(lua_type(L, idx)) {
+        case LUA_TNUMBER:
+            if(lua_isinteger(L, idx)) {
+                key->type = S_INTEGER;
+                key->u.i = (ErlNifSInt64)lua_tointeger(L, idx);
+                return 1;
+            }
+            key->type = S_NUMBER;
+            key->u.d = lua_tonumber(L, idx);
+            return normalize_key(key);
+
+        case LUA_TSTRING: {
+            size_t len;
+            key->type = S_STRING;
+            key->u.s = lua_tolstring(L, idx, &len);
+            key->len = len;
+            return len <= UINT32_MAX;
+        }
+
+        case LUA_TBOOLEAN:
+            key->type = S_BOOLEAN;
+            key->u.b = lua_toboolean(L, idx);
+            return 1;
+
+        default:
+            return 0;
+    }
+}
+
+static void push_table(lua_State *L, shared_t *shared, const shared_table_t *t);
+
+static void
+push_value(lua_State *L, shared_t *shared, const shared_value_t *v) {
+    switch(v->type) {
+        case S_BOOLEAN: lua_pushboolean(L, v->u.b); break;
+        case S_INTEGER: lua_pushinteger(L, (lua_Integer)v->u.i); break;
+        case S_NUMBER: lua_pushnumber(L, v->u.d); break;
+        case S_STRING: lua_pushlstring(L, v->u.s, v->len); break;
+        case S_TABLE: push_table(L, shared, v->u.t); break;
+        default: lua_pushnil(L); break;
+    }
+}
+
+/*
+ * Push the key and the value at the given position
+ */
+static void
+push_pair(lua_State *L, shared_t *shared, const shared_table_t *t, size_t pos) {
+    if(pos < t->narr) {
+        lua_pushinteger(L, (lua_Integer)pos + 1);
+        push_value(L, shared, &t->array[pos]);
+    } else {
+        push_value(L, shared, &t->entries[pos - t->narr].key);
+        push_value(L, shared, &t->entries[pos - t->narr].value);
+    }
+}
+
+static int
+shared_index(lua_State *L) {
+    shared_ref_t *ref = (shared_ref_t*)luaL_checkudata(L, 1, SHARED_META);
+    shared_value_t key;
+    long pos;
+    if(!lua_key(L, 2, &key) || (pos = table_pos(ref->table, &key)) < 0) {
+        lua_pushnil(L);
+    } else if((size_t)pos < ref->table->narr) {
+        push_value(L, ref->shared, &ref->table->array[pos]);
+    } else {
+        push_value(L, ref->shared, &ref->table->entries[pos - ref->table->narr].value);
+    }
+    return 1;
+}
+
+static int
+shared_newindex(lua_State *L) {
+    return luaL_error(L, "attempt to modify the shared data");
+}
+
+static int
+shared_len(lua_State *L) {
+    shared_ref_t *ref = (shared_ref_t*)luaL_checkudata(L, 1, SHARED_META);
+    lua_pushinteger(L, (lua_Integer)ref->table->len);
+    return 1;
+}
+
+static int
+shared_next(lua_State *L) {
+    shared_ref_t *ref = (shared_ref_t*)luaL_checkudata(L, 1, SHARED_META);
+    const shared_table_t *t = ref->table;
+    shared_value_t key;
+    size_t pos = 0;
+    long found;
+
+    lua_settop(L, 2);
+    if(!lua_isnil(L, 2)) {
+        if(!lua_key(L, 2, &key) || (found = table_pos(t, &key)) < 0) {
+            return luaL_error(L, "invalid key to 'next'");
+        }
+        pos = (size_t)found + 1;
+    }
+    if(pos >= t->narr + t->nentries) {
+        lua_pushnil(L);
+        return 1;
+    }
+    push_pair(L, ref->shared, t, pos);
+    return 2;
+}
+
+static int
+shared_pairs(lua_State *L) {
+    luaL_checkudata(L, 1, SHARED_META);
+    lua_pushcfunction(L, shared_next);
+    lua_pushvalue(L, 1);
+    lua_pushnil(L);
+    return 3;
+}
+
+static int
+shared_gc(lua_State *L) {
+    shared_ref_t *ref = (shared_ref_t*)luaL_checkudata(L, 1, SHARED_META);
+    if(ref->owned) enif_release_resource(ref->shared);
+    ref->owned = 0;
+    return 0;
+}
+
+/*
+ * Push the table of the userdata already made in the state, keyed by the shared tables.
+ * Its values are weak, so the cache does not keep the shared data alive
+ */
+static void
+push_cache(lua_State *L) {
+    if(lua_rawgetp(L, LUA_REGISTRYINDEX, &CACHE_KEY) != LUA_TTABLE) {
+        lua_pop(L, 1);
+        lua_createtable(L, 0, 0);
+        lua_createtable(L, 0, 1);
+        lua_pushstring(L, "v");
+        lua_setfield(L, -2, "__mode");
+        lua_setmetatable(L, -2);
+        lua_pushvalue(L, -1);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, &CACHE_KEY);
+    }
+}
+
+/*
+ * Push a userdata which serves the table straight from the arena and keeps the resource alive.
+ * A table gets one userdata per state, repeated lookups of nested tables reuse it
+ */
+static void
+push_table(lua_State *L, shared_t *shared, const shared_table_t *t) {
+    shared_ref_t *ref;
+
+    push_cache(L);
+    if(lua_rawgetp(L, -1, t) == LUA_TUSERDATA) {
+        ref = (shared_ref_t*)lua_touserdata(L, -1);
+        if(ref->shared == shared && ref->table == t) {
+            lua_remove(L, -2);
+            return;
+        }
+    }
+    lua_pop(L, 1);
+
+    ref = (shared_ref_t*)lua_newuserdata(L, sizeof(shared_ref_t));
+    ref->shared = shared;
+    ref->table = t;
+    ref->owned = 0;
+    if(luaL_newmetatable(L, SHARED_META)) {
+        lua_pushcfunction(L, shared_index);
+        lua_setfield(L, -2, "__index");
+        lua_pushcfunction(L, shared_newindex);
+        lua_setfield(L, -2, "__newindex");
+        lua_pushcfunction(L, shared_len);
+        lua_setfield(L, -2, "__len");
+        lua_pushcfunction(L, shared_pairs);
+        lua_setfield(L, -2, "__pairs");
+        lua_pushcfunction(L, shared_gc);
+        lua_setfield(L, -2, "__gc");
+        lua_pushstring(L, SHARED_META);
+        lua_setfield(L, -2, "__metatable");
+    }
+    lua_setmetatable(L, -2);
+    enif_keep_resource(shared);
+    ref->owned = 1;
+    lua_pushvalue(L, -1);
+    lua_rawsetp(L, -3, t);
+    lua_remove(L, -2);
+}
+
+/*
+ * Push the root table of the shared data. Returns 0 if the term is not a shared data
+ */
+int
+shared_push(ErlNifEnv *env, lua_State *L, ERL_NIF_TERM term) {
+    shared_t *shared;
+    if(!enif_get_resource(env, term, SHARED_RESOURCE, (void**)&shared)) return 0;
+    push_table(L, shared, shared->root);
+    return 1;
+}
+
+/*
+ * Build an immutable copy of the term in a single arena shared by all Lua states.
+ * argv[0] - a list, a tuple or a map
+ */
+ERL_NIF_TERM
+nif_newshared(ErlNifEnv *env, int args, const ERL_NIF_TERM argv[]) {
+    shared_t *shared;
+    shared_value_t root;
+    builder_t b;
+    size_t size = 0;
+    char *arena;
+    ERL_NIF_TERM ret;
+
+    if(!(enif_is_list(env, argv[0]) || enif_is_tuple(env, argv[0]) || enif_is_map(env, argv[0]))
+        || !shared_size(env, argv[0], 0, &size)) {
+        return enif_make_badarg(env);
+    }
+    if(!(arena = enif_alloc(size))) {
+        return enif_make_tuple2(env, enif_make_atom(env, "error"),
+            enif_make_string(env, "Not enough memory", ERL_NIF_LATIN1));
+    }
+    b.env = env;
+    b.cur = arena;
+    if(!shared_build(&b, argv[0], &root)) {
+        enif_free(arena);
+        return enif_make_badarg(env);
+    }
+
+    shared = (shared_t*)enif_alloc_resource(SHARED_RESOURCE, sizeof(shared_t));
+    shared->arena = arena;
+    shared->size = size;
+    shared->root = root.u.t;
+    ret = enif_make_resource(env, shared);
+    enif_release_resource(shared);
+    return enif_make_tuple2(env, enif_make_atom(env, "ok"), ret);
+}
@@ -0,0 +1,227 @@
+#include <string.h>
+#include <erl_nif.h>
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "erlylua.h"
+
+
+/*
+ * Push an Erlang term onto the Lua stack.
+ * Integers and floats become numbers, binaries become strings,
+ * 'true', 'false' and 'nil' atoms become booleans and nil, other atoms become strings,
+ * lists and tuples become sequences and maps become tables.
+ * Returns 0 if the term (or any nested term) could not be converted.
+ */
+int
+push_term(ErlNifEnv *env, lua_State *L, ERL_NIF_TERM term, int depth) {
+    ErlNifSInt64 i;
+    double d;
+    ErlNifBinary bin;
+    char atom[256];
+
+    if(depth > MAX_TERM_DEPTH || !lua_checkstack(L, 3)) return 0;
+
+    if(enif_get_int64(env, term, &i)) {
+        lua_pushinteger(L, (lua_Integer)i);
+    } else if(enif_get_double(env, term, &d)) {
+        lua_pushnumber(L, d);
+    } else if(enif_get_atom(env, term, atom, sizeof(atom), ERL_NIF_LATIN1)) {
+        if(!strcmp(atom, "true")) {
+            lua_pushboolean(L, 1);
+        } else if(!strcmp(atom, "false")) {
+            lua_pushboolean(L, 0);
+        } else if(!strcmp(atom, "nil")) {
+            lua_pushnil(L);
+        } else {
+            lua_pushstring(L, atom);
+        }
+    } else if(enif_inspect_binary(env, term, &bin)) {
+        lua_pushlstring(L, (const char*)bin.data, bin.size);
+    } else if(enif_is_list(env, term)) {
+        ERL_NIF_TERM head, tail = term;
+        unsigned len, n = 0;
+        if(!enif_get_list_length(env, term, &len)) return 0;
+        lua_createtable(L, len, 0);
+        while(enif_get_list_cell(env, tail, &head, &tail)) {
+            if(!push_term(env, L, head, depth+1)) {
+                lua_pop(L, 1);
+                return 0;
+            }
+            lua_rawseti(L, -2, ++n);
+        }
+    } else if(enif_is_tuple(env, term)) {
+        const ERL_NIF_TERM *elems;
+        int arity, n;
+        enif_get_tuple(env, term, &arity, &elems);
+        lua_createtable(L, arity, 0);
+        for(n = 0; n < arity; n++) {
+            if(!push_term(env, L, elems[n], depth+1)) {
+                lua_pop(L, 1);
+                return 0;
+            }
+            lua_rawseti(L, -2, n+1);
+        }
+    } else if(enif_is_map(env, term)) {
+        ErlNifMapIterator iter;
+        ERL_NIF_TERM key, value;
+        size_t size;
+        int ok = 1;
+        enif_get_map_size(env, term, &size);
+        lua_createtable(L, 0, size);
+        enif_map_iterator_create(env, term, &iter, ERL_NIF_MAP_ITERATOR_FIRST);
+        while(ok && enif_map_iterator_get_pair(env, &iter, &key, &value)) {
+            if(!push_term(env, L, key, depth+1)) {
+                ok = 0;
+            } else if(lua_isnil(L, -1) || !push_term(env, L, value, depth+1)) {
+                lua_pop(L, 1);
+                ok = 0;
+            } else {
+                lua_rawset(L, -3);
+                enif_map_iterator_next(env, &iter);
+            }
+        }
+        enif_map_iterator_destroy(env, &iter);
+        if(!ok) {
+            lua_pop(L, 1);
+            return 0;
+        }
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Convert the Lua value at the given index to an Erlang term.
+ * Sequences become lists, other tables become maps,
+ * values which have no Erlang counterpart become their type name atoms.
+ * Returns 0 if the value is nested too deep (e.g. a table with cycles).
+ */
+int
+get_term(ErlNifEnv *env, lua_State *L, int idx, int depth, ERL_NIF_TERM *term) {
+    size_t size;
+    const char *str;
+    int type;
+
+    if(depth > MAX_TERM_DEPTH || !lua_checkstack(L, 3)) return 0;
+
+    idx = lua_absindex(L, idx);
+    switch(type = lua_type(L, idx)) {
+        case LUA_TNIL:
+            *term = enif_make_atom(env, "nil");
+            break;
+
+        case LUA_TBOOLEAN:
+            *term = enif_make_atom(env, lua_toboolean(L, idx) ? "true" : "false");
+            break;
+
+        case LUA_TNUMBER:
+            if(lua_isinteger(L, idx)) {
+                *term = enif_make_int64(env, (ErlNifSInt64)lua_tointeger(L, idx));
+            } else {
+                *term = enif_make_double(env, lua_tonumber(L, idx));
+            }
+            break;
+
+        case LUA_TSTRING:
+            str = lua_tolstring(L, idx, &size);
+            memcpy(enif_make_new_binary(env, size, term), str, size);
+            break;
+
+        case LUA_TTABLE: {
+            size_t len = lua_rawlen(L, idx), count = 0;
+            ERL_NIF_TERM key, value;
+            lua_pushnil(L);
+            while(lua_next(L, idx)) {
+                lua_pop(L, 1);
+                count++;
+            }
+            if(count == len) {
+                *term = enif_make_list(env, 0);
+                for(; len > 0; len--) {
+                    lua_rawgeti(L, idx, len);
+                    if(!get_term(env, L, -1, depth+1, &value)) {
+                        lua_pop(L, 1);
+                        return 0;
+                    }
+                    lua_pop(L, 1);
+                    *term = enif_make_list_cell(env, value, *term);
+                }
+            } else {
+                *term = enif_make_new_map(env);
+                lua_pushnil(L);
+                while(lua_next(L, idx)) {
+                    if(!get_term(env, L, -2, depth+1, &key) || !get_term(env, L, -1, depth+1, &value)) {
+                        lua_pop(L, 2);
+                        return 0;
+                    }
+                    lua_pop(L, 1);
+                    enif_make_map_put(env, *term, key, value, term);
+                }
+            }
+            break;
+        }
+
+        default:
+            *term = enif_make_atom(env, type == LUA_TNONE ? "none" : lua_typename(L, type));
+            break;
+    }
+    return 1;
+}
+
+typedef struct _term_call_t {
+    ErlNifEnv *env;
+    ERL_NIF_TERM term;
+    int ok;
+} term_call_t;
+
+static int
+push_term_call(lua_State *L) {
+    term_call_t *c = (term_call_t*)lua_touserdata(L, 1);
+    c->ok = push_term(c->env, L, c->term, 0);
+    return c->ok ? 1 : 0;
+}
+
+static int
+get_term_call(lua_State *L) {
+    term_call_t *c = (term_call_t*)lua_touserdata(L, 1);
+    c->ok = get_term(c->env, L, 2, 0, &c->term);
+    return 0;
+}
+
+/*
+ * push_term run under lua_pcall, for the callers outside of a Lua call.
+ * A Lua error (e.g. out of memory) fails the conversion instead of unwinding past the caller
+ */
+int
+protected_push_term(ErlNifEnv *env, lua_State *L, ERL_NIF_TERM term) {
+    term_call_t c = { env, term, 0 };
+    if(!lua_checkstack(L, 2)) return 0;
+    lua_pushcfunction(L, push_term_call);
+    lua_pushlightuserdata(L, &c);
+    if(lua_pcall(L, 1, 1, 0) != LUA_OK || !c.ok) {
+        lua_pop(L, 1);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * get_term run under lua_pcall, see protected_push_term
+ */
+int
+protected_get_term(ErlNifEnv *env, lua_State *L, int idx, ERL_NIF_TERM *term) {
+    term_call_t c = { env, 0, 0 };
+    idx = lua_absindex(L, idx);
+    if(!lua_checkstack(L, 3)) return 0;
+    lua_pushcfunction(L, get_term_call);
+    lua_pushlightuserdata(L, &c);
+    lua_pushvalue(L, idx);
+    if(lua_pcall(L, 2, 0, 0) != LUA_OK) {
+        lua_pop(L, 1);
+        return 0;
+    }
+    if(c.ok) *term = c.term;
+    return c.ok;
+}
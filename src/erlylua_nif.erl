@@ -29,6 +29,7 @@ load_nif() ->
 
 
 newstate() -> erlang:nif_error(nif_not_loaded).
+newstate(_Allocator) -> erlang:nif_error(nif_not_loaded).
 close(_L) -> erlang:nif_error(nif_not_loaded).
 version(_L) -> erlang:nif_error(nif_not_loaded).
 absindex(_L, _Idx) -> erlang:nif_error(nif_not_loaded).
@@ -47,10 +48,24 @@ islightuserdata(_L, _Idx) -> erlang:nif_error(nif_not_loaded).
 type(_L, _Idx) -> erlang:nif_error(nif_not_loaded).
 tonumber(_L, _Idx) -> erlang:nif_error(nif_not_loaded).
 tointeger(_L, _Idx) -> erlang:nif_error(nif_not_loaded).
+tonumber_raw(_L, _Idx) -> erlang:nif_error(nif_not_loaded).
+tointeger_raw(_L, _Idx) -> erlang:nif_error(nif_not_loaded).
+tonumbers(_L, _Indices) -> erlang:nif_error(nif_not_loaded).
+tointegers(_L, _Indices) -> erlang:nif_error(nif_not_loaded).
 toboolean(_L, _Idx) -> erlang:nif_error(nif_not_loaded).
 tostring(_L, _Idx) -> erlang:nif_error(nif_not_loaded).
 touserdata(_L, _Idx) -> erlang:nif_error(nif_not_loaded).
 rawlen(_L, _Idx) -> erlang:nif_error(nif_not_loaded).
+pmap(_Chunk, _Inputs, _NWorkers) -> erlang:nif_error(nif_not_loaded).
+register_module(_Name, _Chunk) -> erlang:nif_error(nif_not_loaded).
+unregister_module(_Name) -> erlang:nif_error(nif_not_loaded).
+registered_modules() -> erlang:nif_error(nif_not_loaded).
+timers(_L) -> erlang:nif_error(nif_not_loaded).
+fire_timer(_L, _Id) -> erlang:nif_error(nif_not_loaded).
+newshared(_Data) -> erlang:nif_error(nif_not_loaded).
+pushshared(_L, _Shared) -> erlang:nif_error(nif_not_loaded).
+record(_L, _Filename) -> erlang:nif_error(nif_not_loaded).
+stop_recording(_L) -> erlang:nif_error(nif_not_loaded).
 rawequal(_L, _Idx1, _Idx2) -> erlang:nif_error(nif_not_loaded).
 compare(_L, _Idx1, _Idx2, _Op) -> erlang:nif_error(nif_not_loaded).
 pushnil(_L) -> erlang:nif_error(nif_not_loaded).
@@ -77,6 +92,7 @@ rawseti(_L, _Idx, _I) -> erlang:nif_error(nif_not_loaded).
 setmetatable(_L, _Idx) -> erlang:nif_error(nif_not_loaded).
 setuservalue(_L, _Idx) -> erlang:nif_error(nif_not_loaded).
 pcall(_L, _NArgs, _NRes) -> erlang:nif_error(nif_not_loaded).
+pcall(_L, _NArgs, _NRes, _Traceback) -> erlang:nif_error(nif_not_loaded).
 loadbuffer(_L, _Chunk, _Name) -> erlang:nif_error(nif_not_loaded).
 loadfile(_L, _Filename) -> erlang:nif_error(nif_not_loaded).
 dump(_L, _Strip) -> erlang:nif_error(nif_not_loaded).
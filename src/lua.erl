@@ -19,7 +19,7 @@
 -author("Eugene Khrustalev <eugene.khrustalev@gmail.com>").
 
 %% State manipulation functions
--export([newstate/0, close/1, version/1]).
+-export([newstate/0, newstate/1, close/1, version/1]).
 %% Basic stack manipulation functions
 -export([absindex/2, gettop/1, settop/2, pop/2, pushvalue/2, rotate/3, copy/3, checkstack/2]).
 -export([insert/2, remove/2, replace/2]).
@@ -27,6 +27,7 @@
 -export([isnumber/2, isstring/2, iscfunction/2, isinteger/2, isuserdata/2, islightuserdata/2, type/2]).
 -export([isfunction/2, istable/2, isnil/2, isboolean/2, isthread/2, isnone/2, isnoneornil/2]).
 -export([tonumber/2, tointeger/2, toboolean/2, tostring/2, tobinstring/2, touserdata/2]).
+-export([tonumber_raw/2, tointeger_raw/2, tonumbers/2, tointegers/2]).
 %% Comparision functions
 -export([rawlen/2, rawequal/3, compare/4]).
 %% Push functions
@@ -38,11 +39,21 @@
 -export([setglobal/2, settable/2, setfield/3, seti/3, rawset/2, rawseti/3]).
 -export([setmetatable/2, setuservalue/2]).
 %% Call and load functions
--export([pcall/2, pcall/3, loadbuffer/3, loadfile/2, dump/2, dostring/2, dofile/2]).
+-export([pcall/2, pcall/3, pcall/4, loadbuffer/3, loadfile/2, dump/2, dostring/2, dofile/2]).
 %% Garbage collection
 -export([gc/3]).
 %% Miscellaneous functions
 -export([error/1, error/2, error/3, next/2, concat/2, len/2]).
+%% Parallel functions
+-export([pmap/3]).
+%% Module registry functions
+-export([register_module/2, register_dir/1, unregister_module/1, registered_modules/0, reload/2]).
+%% Timer functions
+-export([schedule_timers/1, fire_timer/2, run_timers/1]).
+%% Shared data functions
+-export([newshared/1, pushshared/2]).
+%% Recording functions
+-export([record/2, stop_recording/1]).
 
 %% Useful functions
 -export([dumpstack/1]).
@@ -64,6 +75,17 @@ newstate() ->
     erlylua_nif:newstate().
 
 
+%%--------------------------------------------------------------------
+-spec newstate(Opts :: [{allocator, default | arena}]) -> L :: lua().
+%%
+%% @doc Create a new Lua state with the given options.
+%% @doc {allocator, arena} allocates the state from large blocks which close/1 frees at once
+%% @doc after running the finalizers (__gc) of the state. Suits short-lived request states
+%%
+newstate(Opts) when is_list(Opts) ->
+    erlylua_nif:newstate(proplists:get_value(allocator, Opts, default)).
+
+
 %%--------------------------------------------------------------------
 -spec close(L :: lua())  -> ok.
 %%
@@ -341,6 +363,46 @@ tointeger(L, Idx) when is_integer(Idx) ->
     erlylua_nif:tointeger(L, Idx).
 
 
+%%--------------------------------------------------------------------
+-spec tonumber_raw(L :: lua(), Idx :: integer()) -> float().
+%%
+%% @doc Convert the Lua value at the given index to the double.
+%% @doc Raise badarg if the value is not a number or a string convertible to a number
+%%
+tonumber_raw(L, Idx) ->
+    erlylua_nif:tonumber_raw(L, Idx).
+
+
+%%--------------------------------------------------------------------
+-spec tointeger_raw(L :: lua(), Idx :: integer()) -> integer().
+%%
+%% @doc Convert the Lua value at the given index to the 64-bit integer.
+%% @doc Raise badarg if the value is not convertible to an integer
+%%
+tointeger_raw(L, Idx) ->
+    erlylua_nif:tointeger_raw(L, Idx).
+
+
+%%--------------------------------------------------------------------
+-spec tonumbers(L :: lua(), Indices :: [integer()]) -> {ok, [float()]} | {error, TypeName :: string()}.
+%%
+%% @doc Convert the Lua values at the given indices to the doubles.
+%% @doc Fails with the type name of the first value which is not a number
+%%
+tonumbers(L, Indices) when is_list(Indices) ->
+    erlylua_nif:tonumbers(L, Indices).
+
+
+%%--------------------------------------------------------------------
+-spec tointegers(L :: lua(), Indices :: [integer()]) -> {ok, [integer()]} | {error, TypeName :: string()}.
+%%
+%% @doc Convert the Lua values at the given indices to the 64-bit integers.
+%% @doc Fails with the type name of the first value which is not an integer
+%%
+tointegers(L, Indices) when is_list(Indices) ->
+    erlylua_nif:tointegers(L, Indices).
+
+
 %%--------------------------------------------------------------------
 -spec toboolean(L :: lua(), Idx :: integer()) -> {ok, true} | {ok, false}.
 %%
@@ -734,6 +796,24 @@ pcall(L, NArgs, NRes) when is_integer(NArgs), is_integer(NRes) ->
     erlylua_nif:pcall(L, NArgs, NRes).
 
 
+%%--------------------------------------------------------------------
+-spec pcall(L :: lua(), NArgs :: integer(), NResults :: integer(), Opts :: [traceback]) ->
+    ok | {error, {Kind, Reason :: term(), Traceback :: binary()}} when
+    Kind :: runtime | memory | handler | gc.
+%%
+%% @doc Call a function in protected mode and return a structured error.
+%% @doc Reason is the error object converted to the Erlang term (a message string becomes a binary).
+%% @doc If Opts contains 'traceback' the Lua stack traceback of the error is returned,
+%% @doc otherwise Traceback is an empty binary
+%%
+pcall(L, NArgs, NRes, Opts) when is_integer(NArgs), is_integer(NRes), is_list(Opts) ->
+    Traceback = case lists:member(traceback, Opts) of
+        true -> 1;
+        false -> 0
+    end,
+    erlylua_nif:pcall(L, NArgs, NRes, Traceback).
+
+
 %%--------------------------------------------------------------------
 -spec loadbuffer(L :: lua(), Chunk :: string() | binary(), Name :: string() | binary()) ->
     ok | {error, Reason :: term()}.
@@ -845,16 +925,17 @@ gc(L, What, Data) when ((What >= 0 andalso What =< 7) orelse What =:= 9), is_int
 %% Miscellaneous functions
 %%====================================================================
 
--spec error(L :: lua()) -> ok.
+-spec error(L :: lua()) -> {error, term()}.
 %%
-%% @doc Generate a Lua error, using the value at the top of the stack as the error object
+%% @doc Generate a Lua error, using the value at the top of the stack as the error object.
+%% @doc The error object is popped and returned as {error, Reason}
 %%
 error(L)  ->
     erlylua_nif:error(L).
 
 
 %%--------------------------------------------------------------------
--spec error(L :: lua(), Msg :: atom() | string() | binary()) -> ok.
+-spec error(L :: lua(), Msg :: atom() | string() | binary()) -> {error, term()}.
 %%
 %% @doc Generate a Lua error, using the Msg parameter as the error object
 %%
@@ -864,7 +945,7 @@ error(L, Msg)  ->
 
 
 %%--------------------------------------------------------------------
--spec error(L :: lua(), Msg :: atom() | string() | binary(), Args :: [term()]) -> ok.
+-spec error(L :: lua(), Msg :: atom() | string() | binary(), Args :: [term()]) -> {error, term()}.
 %%
 %% @doc Format a message using Fmt and Args parameters and generate a Lua error
 %%
@@ -908,6 +989,194 @@ len(L, Idx) when is_integer(Idx) ->
     erlylua_nif:len(L, Idx).
 
 
+%%====================================================================
+%% Parallel functions
+%%====================================================================
+
+-spec pmap(Chunk :: string() | binary(), Inputs :: [term()], Opts :: [{workers, pos_integer()}]) ->
+    {ok, [term()]} | {error, Reason :: term()}.
+%%
+%% @doc Call a Lua chunk (a source or a binary returned by dump/2) once per input term
+%% @doc on a pool of Lua states running on native threads. The states and their threads are kept
+%% @doc between the calls, the chunk gets its own globals table on every call.
+%% @doc Each input is converted to the Lua value and passed as the only argument,
+%% @doc the first returned value is converted back. The results are returned in the order of inputs,
+%% @doc a failed call gives {error, Reason} in place of its result.
+%% @doc The number of states defaults to the number of online schedulers
+%%
+pmap(Chunk, Inputs, Opts) when is_list(Chunk) ->
+    pmap(list_to_binary(Chunk), Inputs, Opts);
+
+pmap(Chunk, Inputs, Opts) when is_binary(Chunk), is_list(Inputs), is_list(Opts) ->
+    Workers = proplists:get_value(workers, Opts, erlang:system_info(schedulers_online)),
+    erlylua_nif:pmap(Chunk, Inputs, Workers).
+
+
+%%====================================================================
+%% Module registry functions
+%%====================================================================
+
+-spec register_module(Name :: atom() | string() | binary(), Chunk :: string() | binary()) ->
+    {ok, Version :: pos_integer()} | {error, Reason :: term()}.
+%%
+%% @doc Compile a Lua chunk once and store its bytecode in the node-wide module registry.
+%% @doc Every Lua state finds registered modules with require() before searching the filesystem.
+%% @doc Registering a module again replaces its bytecode and increments its version
+%%
+register_module(Name, Chunk) ->
+    erlylua_nif:register_module(to_binary(Name), to_binary(Chunk)).
+
+
+%%--------------------------------------------------------------------
+-spec register_dir(Dir :: string() | binary()) ->
+    {ok, [{Name :: binary(), Version :: pos_integer()}]} | {error, Reason :: term()}.
+%%
+%% @doc Register all *.lua files of the directory and its subdirectories.
+%% @doc Module names follow the package.path conventions: "a/b.lua" and "a/b/init.lua" are both registered as "a.b"
+%%
+register_dir(Dir) ->
+    Files = filelib:wildcard("**/*.lua", Dir),
+    register_files(Dir, Files, []).
+
+
+%%--------------------------------------------------------------------
+-spec unregister_module(Name :: atom() | string() | binary()) -> ok.
+%%
+%% @doc Remove a module from the registry
+%%
+unregister_module(Name) ->
+    erlylua_nif:unregister_module(to_binary(Name)).
+
+
+%%--------------------------------------------------------------------
+-spec registered_modules() -> [{Name :: binary(), Version :: pos_integer()}].
+%%
+%% @doc Return names and versions of all registered modules
+%%
+registered_modules() ->
+    erlylua_nif:registered_modules().
+
+
+%%--------------------------------------------------------------------
+-spec reload(L :: lua(), Name :: atom() | string() | binary()) -> ok | {error, Reason :: term()}.
+%%
+%% @doc Drop the module from package.loaded and require it again
+%% @doc picking up the latest registered version. The module value is pushed onto the stack
+%%
+reload(L, Name) ->
+    {ok, Top} = gettop(L),
+    {ok, table} = getglobal(L, package),
+    {ok, table} = getfield(L, -1, loaded),
+    ok = pushnil(L),
+    ok = setfield(L, -2, Name),
+    ok = settop(L, Top),
+    {ok, function} = getglobal(L, require),
+    ok = pushstring(L, Name),
+    pcall(L, 1, 1).
+
+
+%%====================================================================
+%% Timer functions
+%%====================================================================
+
+-spec schedule_timers(L :: lua()) -> {ok, Active :: non_neg_integer()}.
+%%
+%% @doc Arm an Erlang timer for every erlang.timer(ms, fn) and erlang.sleep(ms) called by Lua
+%% @doc since the last call. Each timer sends {lua_timer, L, Id} to the calling process,
+%% @doc which should pass Id to fire_timer/2. Returns the number of waiting Lua timers
+%%
+schedule_timers(L) ->
+    {ok, Timers, Active} = erlylua_nif:timers(L),
+    [erlang:send_after(Ms, self(), {lua_timer, L, Id}) || {Id, Ms} <- Timers],
+    {ok, Active}.
+
+
+%%--------------------------------------------------------------------
+-spec fire_timer(L :: lua(), Id :: integer()) -> ok | {error, Reason :: term()}.
+%%
+%% @doc Resume the coroutine waiting for the timer and schedule its next sleep, if any.
+%% @doc Timers cancelled by erlang.cancel(id) are ignored
+%%
+fire_timer(L, Id) ->
+    Result = erlylua_nif:fire_timer(L, Id),
+    {ok, _} = schedule_timers(L),
+    Result.
+
+
+%%--------------------------------------------------------------------
+-spec run_timers(L :: lua()) -> ok | {error, Reason :: term()}.
+%%
+%% @doc Serve the Lua timers in the calling process until none is left waiting.
+%% @doc Returns the first error raised by a timer coroutine, the other timers keep running
+%% @doc and may be served by calling run_timers/1 again
+%%
+run_timers(L) ->
+    case schedule_timers(L) of
+        {ok, 0} ->
+            ok;
+        {ok, _} ->
+            receive
+                {lua_timer, L, Id} ->
+                    case erlylua_nif:fire_timer(L, Id) of
+                        ok -> run_timers(L);
+                        Error -> Error
+                    end
+            end
+    end.
+
+
+%%====================================================================
+%% Shared data functions
+%%====================================================================
+
+-spec newshared(Data :: list() | tuple() | map()) -> {ok, Shared :: term()} | {error, Reason :: string()}.
+%%
+%% @doc Build an immutable copy of the data once in native memory shared by all Lua states of the node.
+%% @doc Values are converted as by pmap/3: lists and tuples become sequences, maps become tables.
+%% @doc Raises badarg if the data cannot be stored (a value which has no Lua counterpart, too deep
+%% @doc nesting, a nil or NaN key, map keys which become the same Lua key).
+%% @doc Returns {error, Reason} when out of memory.
+%% @doc The memory is freed when the last reference to it from Erlang or Lua is dropped
+%%
+newshared(Data) ->
+    erlylua_nif:newshared(Data).
+
+
+%%--------------------------------------------------------------------
+-spec pushshared(L :: lua(), Shared :: term()) -> ok | {error, Reason :: term()}.
+%%
+%% @doc Push the shared data onto the stack as a read-only userdata.
+%% @doc Indexing, # and pairs() read the values straight from the shared memory
+%%
+pushshared(L, Shared) ->
+    erlylua_nif:pushshared(L, Shared).
+
+
+%%====================================================================
+%% Recording functions
+%%====================================================================
+
+-spec record(L :: lua(), Filename :: string() | binary()) -> ok | {error, Reason :: term()}.
+%%
+%% @doc Log every call made on the state with its arguments and timing into the file
+%% @doc until stop_recording/1 or close/1 is called. Use lua_replay to run the log again.
+%% @doc Shared data passed to pushshared/2 is logged by reference, it can only be replayed
+%% @doc on the same node while the data is alive
+%%
+record(L, Filename) ->
+    erlylua_nif:record(L, to_binary(Filename)).
+
+
+%%--------------------------------------------------------------------
+-spec stop_recording(L :: lua()) -> ok | {error, Reason :: term()}.
+%%
+%% @doc Stop recording the state and flush the log file.
+%% @doc Return {error, Reason} if a part of the log could not be written (e.g. the disk is full)
+%%
+stop_recording(L) ->
+    erlylua_nif:stop_recording(L).
+
+
 %%====================================================================
 %% Useful functions
 %%====================================================================
@@ -925,6 +1194,56 @@ dumpstack(L)  ->
 %% Private functions
 %%====================================================================
 
+%%
+%% @private
+%% @doc Convert a name or a chunk to the binary
+%%
+to_binary(Value) when is_binary(Value) ->
+    Value;
+
+to_binary(Value) when is_list(Value) ->
+    list_to_binary(Value);
+
+to_binary(Value) when is_atom(Value) ->
+    atom_to_binary(Value, utf8).
+
+
+%%--------------------------------------------------------------------
+%%
+%% @private
+%% @doc Register the given files of the directory one by one
+%%
+register_files(_Dir, [], Acc) ->
+    {ok, lists:reverse(Acc)};
+
+register_files(Dir, [File | Files], Acc) ->
+    Name = module_name(File),
+    case file:read_file(filename:join(Dir, File)) of
+        {ok, Chunk} ->
+            case register_module(Name, Chunk) of
+                {ok, Version} -> register_files(Dir, Files, [{Name, Version} | Acc]);
+                Other -> Other
+            end;
+        Other ->
+            Other
+    end.
+
+
+%%--------------------------------------------------------------------
+%%
+%% @private
+%% @doc Make a module name from the file name relative to the registered directory
+%%
+module_name(File) ->
+    Parts = case lists:reverse(filename:split(filename:rootname(File))) of
+        ["init" | Rest] when Rest =/= [] -> lists:reverse(Rest);
+        Reversed -> lists:reverse(Reversed)
+    end,
+    list_to_binary(string:join(Parts, ".")).
+
+
+%%--------------------------------------------------------------------
+
 %%
 %% @private
 %% @doc Test the value at the given index for a given type
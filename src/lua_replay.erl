@@ -0,0 +1,150 @@
+%% Copyright (c) Eugene Khrustalev 2016. All Rights Reserved.
+%%
+%% Licensed under the Apache License, Version 2.0 (the "License");
+%% you may not use this file except in compliance with the License.
+%% You may obtain a copy of the License at
+%%
+%%     http://www.apache.org/licenses/LICENSE-2.0
+%%
+%% Unless required by applicable law or agreed to in writing, software
+%% distributed under the License is distributed on an "AS IS" BASIS,
+%% WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+%% See the License for the specific language governing permissions and
+%% limitations under the License.
+
+%% @author Eugene Khrustalev <eugene.khrustalev@gmail.com>
+%% @doc Read and replay the call logs written by lua:record/2
+
+-module(lua_replay).
+-author("Eugene Khrustalev <eugene.khrustalev@gmail.com>").
+
+-export([read/1, replay/1, report/1]).
+
+
+-type call() :: {Op :: atom(), Args :: [term()], Start :: integer(), Duration :: integer()}.
+-type stat() :: {Op :: atom(), Count :: pos_integer(), Recorded :: integer(), Replayed :: integer()}.
+-export_type([call/0, stat/0]).
+
+
+-define(HEADER, "ERLYLUA", 1).
+
+
+%%====================================================================
+%% API functions
+%%====================================================================
+
+-spec read(Filename :: file:filename()) -> {ok, [call()]} | {error, Reason :: term()}.
+%%
+%% @doc Read the log file. Start and Duration of each call are in nanoseconds,
+%% @doc Start is relative to the lua:record/2 call
+%%
+read(Filename) ->
+    case file:read_file(Filename) of
+        {ok, <<?HEADER, Records/binary>>} ->
+            parse(Records, #{}, []);
+        {ok, _} ->
+            {error, bad_header};
+        Error ->
+            Error
+    end.
+
+
+%%--------------------------------------------------------------------
+-spec replay(Filename :: file:filename()) -> {ok, [stat()]} | {error, Reason :: term()}.
+%%
+%% @doc Run the logged calls one by one against a fresh Lua state and
+%% @doc return the number of calls and the total recorded and replayed time
+%% @doc in nanoseconds per operation, the slowest operations first.
+%% @doc Timers are fired in the logged order. Shared data which is no longer alive
+%% @doc is replaced with nil
+%%
+replay(Filename) ->
+    case read(Filename) of
+        {ok, Calls} ->
+            L = lua:newstate(),
+            try
+                Stats = lists:foldl(fun(Call, Acc) -> run(L, Call, Acc) end, #{}, Calls),
+                {ok, lists:reverse(lists:keysort(4, [{Op, Count, Recorded, Replayed}
+                    || {Op, {Count, Recorded, Replayed}} <- maps:to_list(Stats)]))}
+            after
+                lua:close(L)
+            end;
+        Error ->
+            Error
+    end.
+
+
+%%--------------------------------------------------------------------
+-spec report(Filename :: file:filename()) -> ok | {error, Reason :: term()}.
+%%
+%% @doc Replay the log file and print the timing per operation
+%%
+report(Filename) ->
+    case replay(Filename) of
+        {ok, Stats} ->
+            io:format("~-20s ~10s ~14s ~14s ~10s~n", ["op", "calls", "recorded, us", "replayed, us", "ratio"]),
+            lists:foreach(fun({Op, Count, Recorded, Replayed}) ->
+                io:format("~-20s ~10b ~14.3f ~14.3f ~10.2f~n",
+                    [Op, Count, Recorded / 1000, Replayed / 1000, Replayed / max(Recorded, 1)])
+            end, Stats);
+        Error ->
+            Error
+    end.
+
+
+%%====================================================================
+%% Private functions
+%%====================================================================
+
+%%
+%% @doc Parse the records of the log file
+%%
+parse(<<>>, _Chunks, Acc) ->
+    {ok, lists:reverse(Acc)};
+
+parse(<<$C, Size:32, Hash:64, Rest/binary>>, Chunks, Acc) when byte_size(Rest) >= Size - 8 ->
+    DataSize = Size - 8,
+    <<Data:DataSize/binary, Rest2/binary>> = Rest,
+    parse(Rest2, Chunks#{Hash => Data}, Acc);
+
+parse(<<$R, Size:32, Etf:Size/binary, Rest/binary>>, Chunks, Acc) ->
+    {Op, Args, Start, Duration} = binary_to_term(Etf),
+    parse(Rest, Chunks, [{Op, [resolve(Arg, Chunks) || Arg <- Args], Start, Duration} | Acc]);
+
+parse(_, _Chunks, Acc) ->
+    {error, {truncated, length(Acc)}}.
+
+
+%%
+%% @doc Put the stored binaries back in place of their hashes
+%%
+resolve({'$chunk', Hash}, Chunks) ->
+    maps:get(Hash, Chunks);
+
+resolve(Arg, _Chunks) ->
+    Arg.
+
+
+%%
+%% @doc Run a single call and add its timing to the stats
+%%
+run(L, {Op, Args, _Start, Recorded}, Stats) ->
+    T0 = erlang:monotonic_time(),
+    call(L, Op, Args),
+    Replayed = erlang:convert_time_unit(erlang:monotonic_time() - T0, native, nanosecond),
+    {Count, RecordedSum, ReplayedSum} = maps:get(Op, Stats, {0, 0, 0}),
+    Stats#{Op => {Count + 1, RecordedSum + Recorded, ReplayedSum + Replayed}}.
+
+
+%%
+%% @doc Make the logged call. Shared data is logged by reference, if it is gone
+%% @doc nil keeps the stack of the state as it was recorded
+%%
+call(L, pushshared, [Shared]) ->
+    case catch erlylua_nif:pushshared(L, Shared) of
+        ok -> ok;
+        _ -> erlylua_nif:pushnil(L)
+    end;
+
+call(L, Op, Args) ->
+    catch apply(erlylua_nif, Op, [L | Args]).
@@ -0,0 +1,51 @@
+-- Workloads for lua_bench. Keep them compatible with Lua 5.1 so they run under LuaJIT
+
+function ret_1()
+    return 1
+end
+
+function sum(a,b)
+    return (a or 0) + (b or 0)
+end
+
+function ret_table()
+    return {1, 2, 3, str = "value", 4, 5, bool = true}
+end
+
+function fib(n)
+    if n < 2 then
+        return n
+    end
+    return fib(n - 1) + fib(n - 2)
+end
+
+function loop(n)
+    local s = 0
+    for i = 1, n do
+        s = s + i % 7 * 0.5
+    end
+    return s
+end
+
+function strings(n)
+    local parts = {}
+    for i = 1, n do
+        parts[#parts + 1] = string.format("%d:%s", i, string.rep("x", i % 10))
+    end
+    return #table.concat(parts, ",")
+end
+
+function tables(n)
+    local t = {}
+    for i = 1, n do
+        t[i] = (i * 7919) % n
+    end
+    table.sort(t)
+    local m = {}
+    for i = 1, n do
+        m["k" .. t[i]] = i
+    end
+    return t[n]
+end
+
+return "bench"
@@ -0,0 +1,110 @@
+%% Copyright (c) Eugene Khrustalev 2016. All Rights Reserved.
+%%
+%% Licensed under the Apache License, Version 2.0 (the "License");
+%% you may not use this file except in compliance with the License.
+%% You may obtain a copy of the License at
+%%
+%%     http://www.apache.org/licenses/LICENSE-2.0
+%%
+%% Unless required by applicable law or agreed to in writing, software
+%% distributed under the License is distributed on an "AS IS" BASIS,
+%% WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+%% See the License for the specific language governing permissions and
+%% limitations under the License.
+
+%% @author Eugene Khrustalev <eugene.khrustalev@gmail.com>
+%% @doc Benchmarks of the NIF calls and the Lua workloads of bench.lua.
+%% @doc Build the NIF with each LUA_BACKEND and run lua_bench:run() to compare the backends.
+%% @doc lua_bench:states() compares the allocators in the state per request pattern
+-module(lua_bench).
+-author("Eugene Khrustalev <eugene.khrustalev@gmail.com>").
+
+-export([run/0, run/1, states/0, states/1]).
+
+
+run() ->
+    run(1).
+
+%%
+%% @doc Run every workload and print the time per iteration. Scale multiplies the iterations
+%%
+run(Scale) ->
+    L = lua:newstate(),
+    ok = lua:dofile(L, filename:join(code:lib_dir(erlylua, test), "bench.lua")),
+    ok = lua:dostring(L, "return jit and jit.version or _VERSION"),
+    {ok, Backend} = lua:tostring(L, -1),
+    ok = lua:settop(L, 0),
+    io:format("~s~n~-24s ~10s ~14s~n", [Backend, "workload", "iterations", "us/iteration"]),
+    Results = [bench(L, Name, N * Scale, Fun) || {Name, N, Fun} <- workloads()],
+    lua:close(L),
+    {ok, Backend, Results}.
+
+
+states() ->
+    states(10000).
+
+%%
+%% @doc Create a state, run a request in it and close it N times with each allocator
+%%
+states(N) ->
+    Request = "local t = {} for i = 1, 200 do t[i] = {id = i, name = 'item' .. i} end "
+              "local s = {} for i, v in ipairs(t) do s[#s + 1] = v.name end "
+              "return #table.concat(s, ',')",
+    io:format("~-24s ~10s ~14s~n", ["allocator", "states", "us/state"]),
+    [begin
+         {Time, ok} = timer:tc(fun() -> request(Opts, Request, N) end),
+         io:format("~-24p ~10b ~14.3f~n", [Allocator, N, Time / N]),
+         {Allocator, Time / N}
+     end || {Allocator, Opts} <- [{default, []}, {arena, [{allocator, arena}]}]].
+
+
+%%====================================================================
+%% Private functions
+%%====================================================================
+
+workloads() ->
+    [{"call ret_1()", 100000, fun(L) -> call(L, ret_1, [], 1) end},
+     {"call sum(a, b)", 100000, fun(L) -> call(L, sum, [1, 2.5], 1) end},
+     {"call ret_table()", 20000, fun(L) -> call(L, ret_table, [], 1), lua:dumpstack(L) end},
+     {"fib(25)", 10, fun(L) -> call(L, fib, [25], 1) end},
+     {"loop(1000000)", 10, fun(L) -> call(L, loop, [1000000], 1) end},
+     {"strings(10000)", 20, fun(L) -> call(L, strings, [10000], 1) end},
+     {"tables(10000)", 20, fun(L) -> call(L, tables, [10000], 1) end}].
+
+
+bench(L, Name, N, Fun) ->
+    {Time, ok} = timer:tc(fun() -> repeat(L, N, Fun) end),
+    io:format("~-24s ~10b ~14.3f~n", [Name, N, Time / N]),
+    {Name, N, Time / N}.
+
+
+repeat(_L, 0, _Fun) ->
+    ok;
+
+repeat(L, N, Fun) ->
+    Fun(L),
+    ok = lua:settop(L, 0),
+    repeat(L, N - 1, Fun).
+
+
+request(_Opts, _Request, 0) ->
+    ok;
+
+request(Opts, Request, N) ->
+    L = lua:newstate(Opts),
+    ok = lua:dostring(L, Request),
+    ok = lua:close(L),
+    request(Opts, Request, N - 1).
+
+
+call(L, Name, Args, NRes) ->
+    {ok, function} = lua:getglobal(L, Name),
+    [push(L, Arg) || Arg <- Args],
+    ok = lua:pcall(L, length(Args), NRes).
+
+
+push(L, Arg) when is_integer(Arg) ->
+    ok = lua:pushinteger(L, Arg);
+
+push(L, Arg) when is_float(Arg) ->
+    ok = lua:pushnumber(L, Arg).
@@ -104,6 +104,29 @@ push_access_test() ->
     {ok, boolean} = lua:type(L, -1),
     lua:close(L).
 
+int64_test() ->
+    L = lua:newstate(),
+    Big = 1 bsl 40,
+    ok = lua:pushinteger(L, Big),
+    ok = lua:pushinteger(L, -Big),
+    ok = lua:pushnumber(L, 2.5),
+    {ok, Big} = lua:tointeger(L, 1),
+    Big = lua:tointeger_raw(L, 1),
+    -Big = lua:tointeger_raw(L, 2),
+    2.5 = lua:tonumber_raw(L, 3),
+    {'EXIT', {badarg, _}} = (catch lua:tointeger_raw(L, 3)),
+    {'EXIT', {badarg, _}} = (catch lua:tonumber_raw(L, 4)),
+    {ok, [Big, -Big]} = lua:tointegers(L, [1, -2]),
+    {ok, [2.5, F]} = lua:tonumbers(L, [3, 1]),
+    true = F == Big,
+    {error, _} = lua:tointegers(L, [1, 3]),
+    {'EXIT', {badarg, _}} = (catch lua:pushinteger(L, 1 bsl 64)),
+    ok = lua:createtable(L, 0, 0),
+    ok = lua:pushstring(L, "big"),
+    ok = lua:seti(L, -2, Big),
+    {ok, string} = lua:geti(L, -1, Big),
+    lua:close(L).
+
 get_set_test() ->
     L = lua:newstate(),
     {ok, table} = lua:getglobal(L, table),
@@ -247,6 +270,10 @@ load_test() ->
     ok = lua:loadbuffer(L, Dumped, "dumped"),
     {ok, true} = lua:isfunction(L, -1),
     [function, function] = lua:dumpstack(L),
+    ok = lua:pushstring(L, "not a function"),
+    {error, "string"} = lua:dump(L, false),
+    [function, function, "not a function"] = lua:dumpstack(L),
+    lua:settop(L, 2),
     ok = lua:pcall(L, 0),
     ok = lua:setglobal(L, foo),
     lua:settop(L, 0),
@@ -291,6 +318,34 @@ load_test() ->
 
     lua:close(L).
 
+error_test() ->
+    L = lua:newstate(),
+    ok = lua:loadbuffer(L, "error('plain')", "plain"),
+    {error, _} = lua:pcall(L, 0),
+    ok = lua:loadbuffer(L, "error('100%s %d')", "percent"),
+    {error, Percent} = lua:pcall(L, 0),
+    true = lists:suffix(":1: 100%s %d", Percent),
+    ok = lua:dostring(L, "function fail(x) error(x, 0) end"),
+    {ok, function} = lua:getglobal(L, "fail"),
+    ok = lua:pushstring(L, "message"),
+    {error, {runtime, <<"message">>, Traceback}} = lua:pcall(L, 1, 0, [traceback]),
+    true = binary:match(Traceback, <<"stack traceback:">>) =/= nomatch,
+    {ok, function} = lua:getglobal(L, "fail"),
+    ok = lua:createtable(L, 0, 0),
+    ok = lua:pushinteger(L, 42),
+    ok = lua:setfield(L, -2, code),
+    {error, {runtime, #{<<"code">> := 42}, <<>>}} = lua:pcall(L, 1, 0, []),
+    {ok, function} = lua:getglobal(L, "fail"),
+    ok = lua:pushstring(L, "again"),
+    {error, {runtime, <<"again">>, <<>>}} = lua:pcall(L, 1, 0, []),
+    {ok, 0} = lua:gettop(L),
+    ok = lua:dostring(L, "return 1, 2"),
+    {ok, function} = lua:getglobal(L, "tostring"),
+    ok = lua:pushinteger(L, 3),
+    ok = lua:pcall(L, 1, -1, [traceback]),
+    ["3", 2, 1] = lua:dumpstack(L),
+    lua:close(L).
+
 gc_test() ->
     L = lua:newstate(),
     [ok, ok, ok, ok] =
@@ -302,3 +357,185 @@ gc_test() ->
         {ok, false} -> false
     end,
     lua:close(L).
+
+pmap_test() ->
+    {ok, []} = lua:pmap("return 1", [], []),
+    Square = "local x = ... return x * x",
+    Inputs = lists:seq(1, 1000),
+    Squares = [X * X || X <- Inputs],
+    {ok, Squares} = lua:pmap(Square, Inputs, []),
+    {ok, Squares} = lua:pmap(Square, Inputs, [{workers, 3}]),
+    {ok, Squares} = lua:pmap(Square, Inputs, [{workers, 1}]),
+    {ok, [X * X || X <- lists:seq(1, 1001)]} = lua:pmap(Square, lists:seq(1, 1001), [{workers, 7}]),
+    L = lua:newstate(),
+    ok = lua:loadbuffer(L, "return function(t) return {t.a + t.b, #t.list, t.name} end", "pair"),
+    ok = lua:pcall(L, 0),
+    {ok, Dumped} = lua:dump(L, true),
+    lua:close(L),
+    {ok, [[3, 2, <<"x">>], [7, 0, <<"y">>]]} =
+        lua:pmap(Dumped, [#{a => 1, b => 2, list => [1, 2], name => x},
+                          #{a => 3, b => 4, list => [], name => <<"y">>}], [{workers, 2}]),
+    {ok, [2, {error, _}]} = lua:pmap("local x = ... return x + 1", [1, <<"one">>], []),
+    {error, _} = lua:pmap("qwerty", [1], []).
+
+registry_test() ->
+    {error, _} = lua:register_module(erlylua_broken, "qwerty"),
+    {ok, 1} = lua:register_module(erlylua_mod, "local M = {} function M.f() return 1 end return M"),
+    true = lists:member({<<"erlylua_mod">>, 1}, lua:registered_modules()),
+    L = lua:newstate(),
+    ok = lua:dostring(L, "return require('erlylua_mod').f()"),
+    [1] = lua:dumpstack(L),
+    lua:settop(L, 0),
+    {ok, 2} = lua:register_module(<<"erlylua_mod">>, "return {f = function() return 2 end}"),
+    ok = lua:dostring(L, "return require('erlylua_mod').f()"),
+    [1] = lua:dumpstack(L),
+    lua:settop(L, 0),
+    ok = lua:reload(L, "erlylua_mod"),
+    {ok, true} = lua:istable(L, -1),
+    lua:settop(L, 0),
+    ok = lua:dostring(L, "return require('erlylua_mod').f()"),
+    [2] = lua:dumpstack(L),
+    lua:settop(L, 0),
+
+    Dir = code:lib_dir(erlylua, test),
+    {ok, Registered} = lua:register_dir(Dir),
+    {<<"test">>, _} = lists:keyfind(<<"test">>, 1, Registered),
+    ok = lua:dostring(L, "return require('test')"),
+    ["test"] = lua:dumpstack(L),
+    lua:close(L),
+
+    ok = lua:unregister_module(erlylua_mod),
+    ok = lua:unregister_module(test),
+    false = lists:keymember(<<"erlylua_mod">>, 1, lua:registered_modules()),
+    L2 = lua:newstate(),
+    {error, _} = lua:dostring(L2, "return require('erlylua_mod')"),
+    lua:close(L2).
+
+record_test() ->
+    File = filename:join(code:lib_dir(erlylua, test), "record_test.log"),
+    L = lua:newstate(),
+    ok = lua:record(L, File),
+    {error, _} = lua:record(L, File),
+    Chunk = "local s = 0 for i = 1, 1000 do s = s + i end return s -- long enough to be stored once",
+    ok = lua:dostring(L, Chunk),
+    ok = lua:dostring(L, Chunk),
+    [500500, 500500] = lua:dumpstack(L),
+    ok = lua:pushinteger(L, 1 bsl 40),
+    {ok, Shared} = lua:newshared([1, 2]),
+    ok = lua:pushshared(L, Shared),
+    ok = lua:dostring(L, "erlang.timer(0, function() end)"),
+    ok = lua:run_timers(L),
+    ok = lua:stop_recording(L),
+    ok = lua:pushinteger(L, 1),
+    lua:close(L),
+
+    {ok, Calls} = lua_replay:read(File),
+    [{pushinteger, [1099511627776], _, _}] = [Call || {pushinteger, _, _, _} = Call <- Calls],
+    2 = length([ok || {loadbuffer, [Bin, _], _, _} <- Calls, Bin =:= list_to_binary(Chunk)]),
+    [{pushshared, [_], _, _}] = [Call || {pushshared, _, _, _} = Call <- Calls],
+    [{fire_timer, [1], _, _}] = [Call || {fire_timer, _, _, _} = Call <- Calls],
+    {ok, Stats} = lua_replay:replay(File),
+    {pcall, 3, _, _} = lists:keyfind(pcall, 1, Stats),
+    {fire_timer, 1, _, _} = lists:keyfind(fire_timer, 1, Stats),
+    ok = file:delete(File).
+
+shared_test() ->
+    {ok, S} = lua:newshared(#{<<"cities">> => [#{name => <<"Paris">>, pop => 2148000},
+                                                {<<"Berlin">>, 3645000}],
+                              limit => 2.5, flag => true, 1 => one, 2 => two}),
+    {'EXIT', {badarg, _}} = (catch lua:newshared(#{a => 1, <<"a">> => 2})),
+    {'EXIT', {badarg, _}} = (catch lua:newshared(#{nil => 1})),
+    {'EXIT', {badarg, _}} = (catch lua:newshared(1)),
+    L1 = lua:newstate(),
+    L2 = lua:newstate(),
+    [begin ok = lua:pushshared(L, S), ok = lua:setglobal(L, data) end || L <- [L1, L2]],
+    lua:close(L1),
+    ok = lua:dostring(L2, "return data.cities[1].name, data.cities[2][1], #data.cities, data.limit, data.flag, "
+                          "#data, data[1.0], data.missing"),
+    ["Paris", "Berlin", 2, 2.5, true, 2, "one", nil] = lua:dumpstack(L2),
+    lua:settop(L2, 0),
+    ok = lua:dostring(L2, "local n = 0 for k, v in pairs(data) do n = n + 1 end "
+                          "local p = 0 for i, c in ipairs(data.cities) do p = p + 1 end return n, p"),
+    [6, 2] = lua:dumpstack(L2),
+    lua:settop(L2, 0),
+    ok = lua:dostring(L2, "return rawequal(data.cities, data.cities), rawequal(data.cities[1], data.cities[2])"),
+    [true, false] = lua:dumpstack(L2),
+    lua:settop(L2, 0),
+    {error, _} = lua:dostring(L2, "data.limit = 1"),
+    lua:close(L2).
+
+timer_test() ->
+    L = lua:newstate(),
+    ok = lua:dostring(L, "log = {} "
+        "erlang.timer(20, function() log[#log + 1] = 'a' erlang.sleep(150) log[#log + 1] = 'c' end) "
+        "erlang.timer(100, function() log[#log + 1] = 'b' end) "
+        "local t = erlang.timer(10, function() log[#log + 1] = 'x' end) "
+        "return erlang.cancel(t)"),
+    [true] = lua:dumpstack(L),
+    lua:settop(L, 0),
+    ok = lua:run_timers(L),
+    ok = lua:dostring(L, "return table.concat(log)"),
+    ["abc"] = lua:dumpstack(L),
+    lua:settop(L, 0),
+    ok = lua:dostring(L, "erlang.timer(0, function() error('boom', 0) end)"),
+    {error, "boom"} = lua:run_timers(L),
+    {error, _} = lua:dostring(L, "erlang.sleep(10)"),
+    lua:settop(L, 0),
+    ok = lua:dostring(L, "log = {} "
+        "erlang.timer(50, function() log[#log + 1] = 'c' end) "
+        "local a, b "
+        "a = erlang.timer(0, function() erlang.cancel(a) log[#log + 1] = 'a' end) "
+        "b = erlang.timer(5, function() erlang.cancel(b) log[#log + 1] = 'b' erlang.sleep(0) log[#log + 1] = 'x' end)"),
+    ok = lua:run_timers(L),
+    ok = lua:dostring(L, "return table.concat(log)"),
+    ["abc"] = lua:dumpstack(L),
+    lua:close(L).
+
+arena_test() ->
+    {ok, S} = lua:newshared(#{name => <<"shared">>}),
+    [begin
+         L = lua:newstate([{allocator, arena}]),
+         {ok, _} = lua:version(L),
+         ok = lua:pushshared(L, S),
+         ok = lua:setglobal(L, data),
+         ok = lua:dostring(L, "local t = {} for i = 1, 10000 do t[i] = string.rep('x', i % 1000) end "
+                              "t = nil collectgarbage() return data.name"),
+         ["shared"] = lua:dumpstack(L),
+         ok = lua:close(L)
+     end || _ <- lists:seq(1, 10)],
+    File = filename:join(code:lib_dir(erlylua, test), "arena_test.txt"),
+    L2 = lua:newstate([{allocator, arena}]),
+    ok = lua:pushstring(L2, File),
+    ok = lua:setglobal(L2, path),
+    ok = lua:dostring(L2, "f = io.open(path, 'w') f:write('flushed by __gc')"),
+    ok = lua:close(L2),
+    {ok, <<"flushed by __gc">>} = file:read_file(File),
+    ok = file:delete(File),
+    {'EXIT', {badarg, _}} = (catch lua:newstate([{allocator, unknown}])).
+
+guard_test() ->
+    L = lua:newstate(),
+    {'EXIT', {badarg, _}} = (catch erlylua_nif:settop(L, foo)),
+    {'EXIT', {badarg, _}} = (catch lua:settop(L, -5)),
+    {'EXIT', {badarg, _}} = (catch lua:pushvalue(L, 1)),
+    {'EXIT', {badarg, _}} = (catch lua:settable(L, 1)),
+    {'EXIT', {badarg, _}} = (catch lua:concat(L, 3)),
+    {'EXIT', {badarg, _}} = (catch lua:pcall(L, 2, 1)),
+    {'EXIT', {badarg, _}} = (catch erlylua_nif:gc(L, 8, 0)),
+    ok = lua:dostring(L, "t = setmetatable({}, {__index = function(t, k) error('no ' .. k, 0) end})"),
+    {ok, table} = lua:getglobal(L, t),
+    {error, "no key"} = lua:getfield(L, 1, key),
+    ok = lua:pushstring(L, "other"),
+    {error, "no other"} = lua:gettable(L, 1),
+    {ok, 2} = lua:gettop(L),
+    ok = lua:settop(L, 1),
+    ok = lua:pushnil(L),
+    {ok, false} = lua:next(L, 1),
+    ok = lua:pushstring(L, "missing"),
+    {error, _} = lua:next(L, 1),
+    ok = lua:pushvalue(L, 1),
+    {error, _} = lua:concat(L, 2),
+    {ok, 3} = lua:gettop(L),
+    {error, "boom"} = lua:error(L, "boom"),
+    {ok, 3} = lua:gettop(L),
+    lua:close(L).